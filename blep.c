@@ -0,0 +1,80 @@
+/**
+ * Band-limited step (BLEP) output for -b. Point sampling the TIA's square
+ * bit stream aliases, so with -b render_channels() hands every change in
+ * a channel's level to blep_add(), together with how far before the
+ * sample the TIA clock that caused it fell. A windowed sinc step residual
+ * for that fraction is then added around the edge, so only edges cost
+ * anything. Channels at the true clock put their edges on the sample and
+ * use phase 0; detuned banks put them anywhere in between, which point
+ * sampling turns into jitter.
+ *
+ * Each render group collects its residuals in its own blep_res, and
+ * blep_mix() adds them up in group order, so the output still doesn't
+ * depend on the number of threads. A residual starts BLEP_TAPS/2 samples
+ * before its edge, so the naive mix is delayed by as much.
+ */
+#define BLEP_TAPS 32                /* length of a residual */
+#define BLEP_PHASES 32              /* fractional edge positions in the table */
+#define BLEP_OVER 64                /* integration steps per sample, a multiple of BLEP_PHASES */
+#define BLEP_CUTOFF 0.45            /* in cycles per sample */
+
+static int blep = 0;                /* see -b */
+static float blep_table[BLEP_PHASES][BLEP_TAPS];            /* band-limited minus naive step */
+static float blep_res[MAX_C/GROUP][MAX_BLOCK + BLEP_TAPS];  /* residuals of each group's block */
+static float blep_carry[BLEP_TAPS]; /* residuals that ran past the last block */
+static int blep_delay[BLEP_TAPS/2]; /* delayed naive output */
+static int blep_dpos = 0;
+
+static void blep_init() {
+    int k, p, D = BLEP_TAPS/2, N = BLEP_TAPS*BLEP_OVER;
+    vector<double> step(N + 1);
+
+    //integrate the windowed sinc, step[i] is the step at i/BLEP_OVER - D samples
+    for (k = 0, step[0] = 0; k < N; k++) {
+        double u = (k + 0.5) / BLEP_OVER - D;
+        double sinc = sin(2*M_PI*BLEP_CUTOFF*u) / (M_PI*u);
+        double w = 0.42 + 0.5*cos(M_PI*u/D) + 0.08*cos(2*M_PI*u/D);
+
+        step[k+1] = step[k] + sinc * w / BLEP_OVER;
+    }
+
+    //sample k of a residual is k - D + p/BLEP_PHASES samples after its edge
+    for (p = 0; p < BLEP_PHASES; p++)
+        for (k = 0; k < BLEP_TAPS; k++)
+            blep_table[p][k] = step[k*BLEP_OVER + p*(BLEP_OVER/BLEP_PHASES)] / step[N] - (k >= D ? 1 : 0);
+}
+
+/* an edge of size d that happened frac/65536 of a sample before the sample res points at */
+static inline void blep_add(float *res, uint32_t frac, int d) {
+    const float *t = blep_table[frac * BLEP_PHASES >> 16];
+
+    for (int k = 0; k < BLEP_TAPS; k++)
+        res[k] += d * t[k];
+}
+
+/* delays the summed naive mix of n samples and adds the residuals of all groups */
+static void blep_mix(int *sum, int groups, int n) {
+    float carry[BLEP_TAPS];
+    int x, g, k;
+
+    for (x = 0; x < n; x++) {
+        float r = x < BLEP_TAPS ? blep_carry[x] : 0;
+        int in = sum[x];
+
+        for (g = 0; g < groups; g++)
+            r += blep_res[g][x];
+
+        sum[x] = blep_delay[blep_dpos] + (int)floorf(r + 0.5f);
+        blep_delay[blep_dpos] = in;
+        blep_dpos = (blep_dpos + 1) % (BLEP_TAPS/2);
+    }
+
+    for (k = 0; k < BLEP_TAPS; k++) {
+        carry[k] = n + k < BLEP_TAPS ? blep_carry[n + k] : 0;
+
+        for (g = 0; g < groups; g++)
+            carry[k] += blep_res[g][n + k];
+    }
+
+    memcpy(blep_carry, carry, sizeof(carry));
+}
@@ -0,0 +1,249 @@
+/**
+ * Background encoder for the compressed exports. A thread reads the
+ * recording out of the journal's ring as the audio callback writes it,
+ * woken by enc_push() every FLAC_BLOCK samples, and encodes it into a
+ * FLAC file and a TIAZ file, each under a .part name. Saving posts
+ * ENC_FINISH, which encodes up to the cut, fills in the lengths and
+ * renames both; ENC_CLEAR throws them away.
+ */
+enum {
+    ENC_NONE,
+    ENC_CLEAR,
+    ENC_FINISH,
+};
+
+static SDL_mutex *enc_lock;
+static SDL_cond *enc_cond;
+static SDL_sem *enc_done;
+static uint64_t enc_r;              /* next sample in the journal to encode, encoder thread only */
+static int enc_cmd = ENC_NONE;      /* guarded by enc_lock */
+static uint64_t enc_cut;            /* where the recording enc_cmd is for ends, guarded by enc_lock */
+static string enc_stem;             /* file name without extension, guarded by enc_lock */
+static char flac_part[256], tiaz_part[256];     /* files being encoded into */
+static size_t flac_bytes, tiaz_bytes;           /* sizes of the last finished files */
+static uint64_t enc_total;          /* samples in the last finished files */
+
+/* rewrites the header now that we know how long it got, then renames part to name */
+static size_t enc_close(FILE *f, const vector<uint8_t> &header, const char *part, string name) {
+    size_t ret;
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header[0], header.size(), 1, f);
+    fseek(f, 0, SEEK_END);
+    ret = ftell(f);
+    fclose(f);
+
+    remove(name.c_str());
+    rename(part, name.c_str());
+    return ret;
+}
+
+static int enc_thread(void *unused) {
+    vector<int16_t> in, pending;
+    vector<uint8_t> out, tout;
+    FILE *f = NULL, *tf = NULL;
+    uint32_t frameno = 0;
+    uint64_t total = 0;
+    tiaz_enc tz;
+
+    for (;;) {
+        int cmd;
+        string stem;
+        uint64_t end;
+
+        SDL_LockMutex(enc_lock);
+
+        while (journal_w - enc_r < FLAC_BLOCK && enc_cmd == ENC_NONE)
+            SDL_CondWait(enc_cond, enc_lock);
+
+        //a command only covers what was written before it, the rest is the next recording
+        end = enc_cmd != ENC_NONE ? enc_cut : journal_w;
+        cmd = enc_cmd;
+        stem = enc_stem;
+        enc_cmd = ENC_NONE;
+        SDL_UnlockMutex(enc_lock);
+
+        memory_barrier();
+
+        if (cmd == ENC_CLEAR) {
+            //anything not encoded yet belongs to the recording being thrown away
+            pending.clear();
+            enc_r = end;
+
+            if (f) {
+                fclose(f);
+                fclose(tf);
+                remove(flac_part);
+                remove(tiaz_part);
+                f = tf = NULL;
+            }
+
+            SDL_SemPost(enc_done);
+            continue;
+        }
+
+        in.clear();
+
+        while (enc_r < end) {
+            size_t pos = enc_r & (JOURNAL_SAMPLES-1);
+            size_t n = min(end - enc_r, (uint64_t)(JOURNAL_SAMPLES - pos));
+
+            in.insert(in.end(), &journal->samples[pos], &journal->samples[pos] + n);
+            enc_r += n;
+        }
+
+        pending.insert(pending.end(), in.begin(), in.end());
+        out.clear();
+        tout.clear();
+
+        if (!f && pending.size()) {
+            f = fopen(flac_part, "wb");
+            tf = fopen(tiaz_part, "wb");
+            frameno = 0;
+            total = 0;
+            tz.reset();
+            flac_header(out, 0);
+            tiaz_header(tout, 0);
+        }
+
+        if (tf && in.size())
+            tiaz_push(tz, &in[0], in.size(), tout);
+
+        size_t x = 0;
+
+        for (; x + FLAC_BLOCK <= pending.size(); x += FLAC_BLOCK, total += FLAC_BLOCK)
+            flac_frame(out, &pending[x], FLAC_BLOCK, frameno++);
+
+        if (cmd == ENC_FINISH && x < pending.size()) {
+            flac_frame(out, &pending[x], pending.size() - x, frameno++);
+            total += pending.size() - x;
+            x = pending.size();
+        }
+
+        pending.erase(pending.begin(), pending.begin() + x);
+
+        if (cmd == ENC_FINISH && tf)
+            tiaz_finish(tz, tout);
+
+        if (f && out.size())
+            fwrite(&out[0], out.size(), 1, f);
+
+        if (tf && tout.size())
+            fwrite(&tout[0], tout.size(), 1, tf);
+
+        if (cmd == ENC_FINISH) {
+            flac_bytes = tiaz_bytes = 0;
+            enc_total = total;
+
+            if (f) {
+                out.clear();
+                tout.clear();
+                flac_header(out, total);
+                tiaz_header(tout, tz.total);
+                flac_bytes = enc_close(f, out, flac_part, stem + ".flac");
+                tiaz_bytes = enc_close(tf, tout, tiaz_part, stem + ".tiaz");
+                f = tf = NULL;
+            }
+
+            SDL_SemPost(enc_done);
+        }
+    }
+
+    return 0;
+}
+
+/* call after journal_init(), the recording starts where the journal is */
+static void enc_init() {
+    sprintf(flac_part, "%i.flac.part", T);
+    sprintf(tiaz_part, "%i.tiaz.part", T);
+    enc_r = journal_w;
+    enc_lock = SDL_CreateMutex();
+    enc_cond = SDL_CreateCond();
+    enc_done = SDL_CreateSemaphore(0);
+    SDL_CreateThread(enc_thread, NULL);
+}
+
+/* called from the audio callback once it has written samples [from, to) */
+static void enc_push(uint64_t from, uint64_t to) {
+    if (from / FLAC_BLOCK == to / FLAC_BLOCK)
+        return;
+
+    SDL_LockMutex(enc_lock);
+    SDL_CondSignal(enc_cond);
+    SDL_UnlockMutex(enc_lock);
+}
+
+/**
+ * Queues cmd for everything written so far. Call it with the audio locked,
+ * in the same place the recording itself is cut, and enc_wait() for it
+ * after unlocking so the encoder never holds up the audio.
+ */
+static void enc_post(int cmd, string stem) {
+    SDL_LockMutex(enc_lock);
+    enc_cmd = cmd;
+    enc_stem = stem;
+    enc_cut = journal_w;
+    SDL_CondSignal(enc_cond);
+    SDL_UnlockMutex(enc_lock);
+}
+
+static void enc_wait() {
+    SDL_SemWait(enc_done);
+}
+
+static void enc_clear() {
+    enc_post(ENC_CLEAR, "");
+    enc_wait();
+}
+
+/* the name of the files without extension */
+static string enc_name(string base) {
+    char name[256];
+
+    sprintf(name, "%s%i-%i", base.c_str(), T, number);
+    return name;
+}
+
+/* decodes name with decode and compares it to all of ref */
+static bool enc_verify(string name, bool (*decode)(const vector<uint8_t>&, vector<int16_t>&), const vector<int16_t> &ref) {
+    vector<uint8_t> in;
+    vector<int16_t> dec;
+    FILE *f = fopen(name.c_str(), "rb");
+
+    if (!f)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    in.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+
+    if (in.size() && fread(&in[0], in.size(), 1, f) != 1)
+        in.clear();
+
+    fclose(f);
+
+    return decode(in, dec) && dec.size() == ref.size() &&
+           equal(dec.begin(), dec.end(), ref.begin());
+}
+
+/* waits for the ENC_FINISH posted when rec was cut off and checks both files against rec */
+static void write_compressed(string base, const vector<int16_t> &rec) {
+    string name = enc_name(base);
+
+    enc_wait();
+
+    if (!flac_bytes)
+        return;
+
+    //past the length of the journal the encoders still have all of it, but rec only has the end
+    if (enc_total > rec.size() && rec.size() == JOURNAL_SAMPLES) {
+        printf("Wrote %li byte FLAC and %li byte TIAZ to %s, longer than the WAV so not verified\n",
+            (long)flac_bytes, (long)tiaz_bytes, name.c_str());
+        return;
+    }
+
+    printf("Wrote %li byte FLAC to %s.flac (%.1f:1), %s\n", (long)flac_bytes, name.c_str(), rec.size()*2.0 / flac_bytes,
+        enc_total == rec.size() && enc_verify(name + ".flac", flac_decode, rec) ? "verified" : "VERIFY FAILED");
+    printf("Wrote %li byte TIAZ to %s.tiaz (%.1f:1), %s\n", (long)tiaz_bytes, name.c_str(), rec.size()*2.0 / tiaz_bytes,
+        enc_total == rec.size() && enc_verify(name + ".tiaz", tiaz_decode, rec) ? "verified" : "VERIFY FAILED");
+}
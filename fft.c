@@ -0,0 +1,56 @@
+/**
+ * In-place iterative radix-2 FFT. The twiddle factors live in an fftplan
+ * that is only read by fft(), so one plan can be shared between threads.
+ */
+struct fftplan {
+    int n;                  /* power of two */
+    vector<float> wr, wi;   /* exp(-2*pi*i*k/n) for k < n/2 */
+};
+
+static void fft_init(fftplan &p, int n) {
+    p.n = n;
+    p.wr.resize(n/2);
+    p.wi.resize(n/2);
+
+    for (int k = 0; k < n/2; k++) {
+        p.wr[k] = cos(2*M_PI*k/n);
+        p.wi[k] = -sin(2*M_PI*k/n);
+    }
+}
+
+static void fft(const fftplan &p, float *re, float *im) {
+    int n = p.n, i, j, k, len;
+
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+
+        j ^= bit;
+
+        if (i < j) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len >> 1, stride = n / len;
+
+        for (i = 0; i < n; i += len) {
+            float *ar = re + i, *ai = im + i, *br = ar + half, *bi = ai + half;
+
+            for (k = 0; k < half; k++) {
+                float cr = p.wr[k*stride], ci = p.wi[k*stride];
+                float tr = br[k]*cr - bi[k]*ci;
+                float ti = br[k]*ci + bi[k]*cr;
+
+                br[k] = ar[k] - tr;
+                bi[k] = ai[k] - ti;
+                ar[k] += tr;
+                ai[k] += ti;
+            }
+        }
+    }
+}
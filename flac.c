@@ -0,0 +1,449 @@
+/**
+ * FLAC export, encoded in FLAC_BLOCK sample frames by the background
+ * encoder in encoder.c as the samples arrive, so saving only has to
+ * encode the last, partial block.
+ *
+ * Only the subset of FLAC we need is written: mono, 16 bits, CONSTANT,
+ * VERBATIM, FIXED and LPC subframes with partitioned Rice coding, all
+ * within the streamable subset (partition order <= 8, LPC order <= 12
+ * at our rate) so that any decoder plays them. TIA output is a sum of
+ * periodic bit patterns, so besides the fixed predictors we try an LPC
+ * predictor whose only coefficient is a 1 at lag P, i.e. "same as one
+ * period ago", which only catches the highest notes. Everything else
+ * falls back on the fixed predictors, whose residual is zero except at
+ * edges. Expect about 15:1 on the highest square waves, 1.5-8:1 on
+ * held notes and under 2:1 on the noise tones; tiaz.c is the compact
+ * format. flac_decode() reads the same subset back to check that the file
+ * is bit-exact.
+ */
+#define FLAC_BLOCK 4096
+#define FLAC_MAX_PORDER 8   /* streamable subset */
+#define FLAC_MAX_LAG 12     /* longest period the LPC predictor looks for, subset LPC order */
+
+struct bitwriter {
+    vector<uint8_t> buf;
+    uint64_t acc;
+    int n;
+
+    bitwriter() : acc(0), n(0) {}
+
+    void put(uint32_t v, int bits) {
+        if (bits == 0)
+            return;
+
+        acc = (acc << bits) | (v & (0xFFFFFFFFu >> (32 - bits)));
+        n += bits;
+
+        while (n >= 8) {
+            n -= 8;
+            buf.push_back(acc >> n);
+        }
+    }
+
+    void unary(uint32_t q) {
+        for (; q >= 32; q -= 32)
+            put(0, 32);
+
+        put(1, q + 1);
+    }
+
+    void align() {
+        if (n)
+            put(0, 8 - n);
+    }
+};
+
+struct bitreader {
+    const uint8_t *buf;
+    size_t size, pos;   /* pos in bits */
+
+    bitreader(const uint8_t *b, size_t s) : buf(b), size(s), pos(0) {}
+
+    bool eof() const {
+        return pos >= size*8;
+    }
+
+    uint32_t get(int bits) {
+        uint32_t ret = 0;
+
+        for (; bits > 0; bits--, pos++)
+            ret = (ret << 1) | (pos < size*8 ? (buf[pos >> 3] >> (7 - (pos & 7))) & 1 : 0);
+
+        return ret;
+    }
+
+    int32_t sget(int bits) {
+        uint32_t v = get(bits);
+        return bits && (v >> (bits - 1)) ? (int32_t)(v | ~(0xFFFFFFFFu >> (32 - bits))) : (int32_t)v;
+    }
+
+    uint32_t unary() {
+        uint32_t q = 0;
+
+        while (!eof() && !get(1))
+            q++;
+
+        return q;
+    }
+
+    void align() {
+        pos = (pos + 7) & ~(size_t)7;
+    }
+};
+
+static uint8_t flac_crc8(const uint8_t *p, size_t n) {
+    uint8_t crc = 0;
+
+    for (; n; n--, p++) {
+        crc ^= *p;
+
+        for (int x = 0; x < 8; x++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+
+    return crc;
+}
+
+static uint16_t flac_crc16(const uint8_t *p, size_t n) {
+    uint16_t crc = 0;
+
+    for (; n; n--, p++) {
+        crc ^= *p << 8;
+
+        for (int x = 0; x < 8; x++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+
+    return crc;
+}
+
+static void fixed_residual(const int16_t *s, int n, int order, int32_t *res) {
+    int x;
+
+    for (x = order; x < n; x++) {
+        switch (order) {
+        case 0: res[x] = s[x]; break;
+        case 1: res[x] = s[x] - s[x-1]; break;
+        case 2: res[x] = s[x] - 2*s[x-1] + s[x-2]; break;
+        case 3: res[x] = s[x] - 3*s[x-1] + 3*s[x-2] - s[x-3]; break;
+        case 4: res[x] = s[x] - 4*s[x-1] + 6*s[x-2] - 4*s[x-3] + s[x-4]; break;
+        }
+    }
+}
+
+static void lag_residual(const int16_t *s, int n, int lag, int32_t *res) {
+    int x;
+
+    for (x = lag; x < n; x++)
+        res[x] = s[x] - s[x-lag];
+}
+
+static inline uint32_t zigzag(int32_t r) {
+    return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+/* best Rice parameter and its cost in bits for u[0..n-1] */
+static int rice_param(const int32_t *res, int n, uint64_t *bits) {
+    int x, p, best = 0;
+    uint64_t sum = 0;
+
+    for (x = 0; x < n; x++)
+        sum += zigzag(res[x]);
+
+    *bits = ~(uint64_t)0;
+
+    for (p = 0; p < 15; p++) {
+        //sum(u >> p) is at most sum >> p plus one per sample, close enough to choose by
+        uint64_t b = (uint64_t)n*(p + 1) + (sum >> p);
+
+        if (b < *bits) {
+            *bits = b;
+            best = p;
+        }
+    }
+
+    return best;
+}
+
+/* bits needed for the residual at partition order po, params written to params[] */
+static uint64_t rice_cost(const int32_t *res, int n, int order, int po, int *params) {
+    int part, parts = 1 << po, len = n >> po;
+    uint64_t total = 2 + 4;   /* coding method, partition order */
+
+    for (part = 0; part < parts; part++) {
+        int start = part ? part*len : order;
+        uint64_t b;
+
+        params[part] = rice_param(res + start, (part+1)*len - start, &b);
+        total += 4 + b;
+    }
+
+    return total;
+}
+
+/* tries each partition order for res, updates best* if any of them wins */
+static bool try_residual(const int32_t *res, int n, int order, uint64_t header, uint64_t *best, int *bestpo, int *bestparams) {
+    int params[1 << FLAC_MAX_PORDER];
+    bool ret = false;
+
+    for (int po = 0; po <= FLAC_MAX_PORDER; po++) {
+        if (n % (1 << po) || (n >> po) <= order)
+            break;
+
+        uint64_t b = header + rice_cost(res, n, order, po, params);
+
+        if (b < *best) {
+            *best = b;
+            *bestpo = po;
+            memcpy(bestparams, params, sizeof(int) << po);
+            ret = true;
+        }
+    }
+
+    return ret;
+}
+
+static void write_subframe(bitwriter &bw, const int16_t *s, int n) {
+    static int32_t res[FLAC_BLOCK];
+    int bestparams[1 << FLAC_MAX_PORDER];
+    int x, order, lag, bestorder = -1, bestlag = 0, bestpo = 0;
+    uint64_t best = (uint64_t)n*16;
+
+    for (x = 1; x < n && s[x] == s[0]; x++);
+
+    if (x == n) {
+        bw.put(0x00, 8);        /* CONSTANT */
+        bw.put(s[0], 16);
+        return;
+    }
+
+    for (order = 0; order <= 4 && order < n; order++) {
+        fixed_residual(s, n, order, res);
+
+        if (try_residual(res, n, order, order*16, &best, &bestpo, bestparams))
+            bestorder = order;
+    }
+
+    //warmup, precision, shift and lag coefficients
+    for (lag = 2; lag <= FLAC_MAX_LAG && lag < n; lag++) {
+        lag_residual(s, n, lag, res);
+
+        if (try_residual(res, n, lag, lag*16 + 4 + 5 + lag*2, &best, &bestpo, bestparams))
+            bestlag = lag;
+    }
+
+    if (bestlag) {
+        bw.put(0x40 | ((bestlag - 1) << 1), 8);     /* LPC */
+
+        for (x = 0; x < bestlag; x++)
+            bw.put(s[x], 16);
+
+        bw.put(2 - 1, 4);       /* two bit coefficients */
+        bw.put(0, 5);           /* no shift */
+
+        for (x = 0; x < bestlag; x++)
+            bw.put(x == bestlag - 1 ? 1 : 0, 2);
+
+        lag_residual(s, n, bestlag, res);
+        bestorder = bestlag;
+    } else if (bestorder >= 0) {
+        bw.put(0x10 | (bestorder << 1), 8);     /* FIXED */
+
+        for (x = 0; x < bestorder; x++)
+            bw.put(s[x], 16);
+
+        fixed_residual(s, n, bestorder, res);
+    } else {
+        bw.put(0x02, 8);        /* VERBATIM */
+
+        for (x = 0; x < n; x++)
+            bw.put(s[x], 16);
+
+        return;
+    }
+
+    bw.put(0, 2);
+    bw.put(bestpo, 4);
+
+    for (int part = 0, len = n >> bestpo; part < (1 << bestpo); part++) {
+        int p = bestparams[part];
+
+        bw.put(p, 4);
+
+        for (x = part ? part*len : bestorder; x < (part+1)*len; x++) {
+            uint32_t u = zigzag(res[x]);
+
+            bw.unary(u >> p);
+            bw.put(u, p);
+        }
+    }
+}
+
+static void flac_frame(vector<uint8_t> &out, const int16_t *s, int n, uint32_t frameno) {
+    bitwriter bw;
+
+    bw.put(0xFFF8, 16);                     /* sync, fixed blocksize */
+    bw.put(n == FLAC_BLOCK ? 0xC : 0x7, 4); /* 4096, or 16 bit size at end of header */
+    bw.put(0xD, 4);                         /* 16 bit rate in Hz at end of header */
+    bw.put(0x0, 4);                         /* mono */
+    bw.put(0x4, 3);                         /* 16 bits per sample */
+    bw.put(0, 1);
+
+    //frame number, UTF-8 style
+    if (frameno < 0x80)
+        bw.put(frameno, 8);
+    else {
+        int len = 2;
+        while (frameno >> (5*len + 1)) len++;
+
+        bw.put((0xFF00 >> len) | (frameno >> (6*(len-1))), 8);
+
+        for (int x = len - 2; x >= 0; x--)
+            bw.put(0x80 | ((frameno >> (6*x)) & 0x3F), 8);
+    }
+
+    if (n != FLAC_BLOCK)
+        bw.put(n - 1, 16);
+
+    bw.put(FREQ, 16);
+    bw.put(flac_crc8(&bw.buf[0], bw.buf.size()), 8);
+
+    write_subframe(bw, s, n);
+    bw.align();
+    bw.put(flac_crc16(&bw.buf[0], bw.buf.size()), 16);
+
+    out.insert(out.end(), bw.buf.begin(), bw.buf.end());
+}
+
+static void flac_header(vector<uint8_t> &out, uint64_t total) {
+    bitwriter bw;
+
+    bw.put('f', 8); bw.put('L', 8); bw.put('a', 8); bw.put('C', 8);
+    bw.put(0x80, 8);            /* last metadata block, STREAMINFO */
+    bw.put(34, 24);
+    bw.put(FLAC_BLOCK, 16);
+    bw.put(FLAC_BLOCK, 16);
+    bw.put(0, 24);              /* frame sizes unknown */
+    bw.put(0, 24);
+    bw.put(FREQ, 20);
+    bw.put(0, 3);               /* one channel */
+    bw.put(15, 5);              /* 16 bits */
+    bw.put(total >> 32, 4);
+    bw.put(total, 32);
+
+    for (int x = 0; x < 16; x++)
+        bw.put(0, 8);           /* no MD5 */
+
+    out.insert(out.end(), bw.buf.begin(), bw.buf.end());
+}
+
+/* decodes what flac_frame() writes, returns false on anything else */
+static bool flac_decode(const vector<uint8_t> &in, vector<int16_t> &out) {
+    if (in.size() < 42 || memcmp(&in[0], "fLaC", 4))
+        return false;
+
+    bitreader br(&in[0], in.size());
+    br.pos = 42*8;
+
+    while (!br.eof()) {
+        size_t start = br.pos / 8;
+        int n, x;
+
+        if (br.get(16) != 0xFFF8)
+            return false;
+
+        int bscode = br.get(4);
+        if (br.get(4) != 0xD || br.get(4) != 0 || br.get(3) != 4 || br.get(1))
+            return false;
+
+        //skip the frame number
+        uint32_t b = br.get(8);
+        if (b & 0x80)
+            for (b <<= 1; b & 0x80; b <<= 1)
+                br.get(8);
+
+        if (bscode == 0xC)      n = FLAC_BLOCK;
+        else if (bscode == 0x7) n = br.get(16) + 1;
+        else                    return false;
+
+        br.get(16);             /* sample rate */
+
+        if (br.get(8) != flac_crc8(&in[start], br.pos/8 - 1 - start))
+            return false;
+
+        size_t base = out.size();
+        int type = br.get(8);
+        out.resize(base + n);
+        int16_t *s = &out[base];
+
+        if (type == 0x00) {
+            int16_t v = br.sget(16);
+            for (x = 0; x < n; x++)
+                s[x] = v;
+        } else if (type == 0x02) {
+            for (x = 0; x < n; x++)
+                s[x] = br.sget(16);
+        } else if (((type & 0x71) == 0x10 && ((type >> 1) & 7) <= 4) || (type & 0x41) == 0x40) {
+            bool lpc = type & 0x40;
+            int order = lpc ? ((type >> 1) & 31) + 1 : (type >> 1) & 7;
+            int precision = 0, shift = 0, qlp[32];
+
+            for (x = 0; x < order; x++)
+                s[x] = br.sget(16);
+
+            if (lpc) {
+                precision = br.get(4) + 1;
+                shift = br.sget(5);
+
+                if (precision == 16 || shift < 0)
+                    return false;
+
+                for (x = 0; x < order; x++)
+                    qlp[x] = br.sget(precision);
+            }
+
+            if (br.get(2) != 0)
+                return false;
+
+            int po = br.get(4), len = n >> po;
+
+            for (int part = 0; part < (1 << po); part++) {
+                int p = br.get(4);
+
+                if (p == 15)
+                    return false;
+
+                for (x = part ? part*len : order; x < (part+1)*len; x++) {
+                    uint32_t u = (br.unary() << p) | br.get(p);
+                    int32_t r = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+
+                    if (lpc) {
+                        int64_t sum = 0;
+
+                        for (int j = 0; j < order; j++)
+                            sum += (int64_t)qlp[j] * s[x-1-j];
+
+                        s[x] = r + (int32_t)(sum >> shift);
+                        continue;
+                    }
+
+                    switch (order) {
+                    case 0: s[x] = r; break;
+                    case 1: s[x] = r + s[x-1]; break;
+                    case 2: s[x] = r + 2*s[x-1] - s[x-2]; break;
+                    case 3: s[x] = r + 3*s[x-1] - 3*s[x-2] + s[x-3]; break;
+                    case 4: s[x] = r + 4*s[x-1] - 6*s[x-2] + 4*s[x-3] - s[x-4]; break;
+                    }
+                }
+            }
+        } else
+            return false;
+
+        br.align();
+
+        if (br.get(16) != flac_crc16(&in[start], br.pos/8 - 2 - start))
+            return false;
+    }
+
+    return true;
+}
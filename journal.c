@@ -0,0 +1,321 @@
+/**
+ * Crash-safe session journal, which is also where the recording lives.
+ * A memory mapped file holds a header page, a ring of notes and a ring of
+ * samples, and synth() renders straight into the sample ring: the current
+ * recording is [start, journal_w) of it, the encoders and the view read
+ * it in place and saving copies it out once. If the file can't be mapped
+ * the same layout goes on the heap and there's just nothing to recover.
+ *
+ * The file is written out in full up front, and the audio callback never
+ * writes the mapping outside the sample ring: journal_w lives in RAM.
+ * Once a second a background thread syncs the pages the write head has
+ * left behind and only then stores how far it got in nsamples, so a power
+ * cut loses about a second. The page under the head is never synced, and
+ * the thread also write faults the next JOURNAL_AHEAD samples, so the
+ * callback neither writes to a page that is being written back nor takes
+ * the fault itself.
+ *
+ * The main thread writes the rest of the header and the notes. A saved
+ * recording is [start, nsamples) and [0, nnotes), so clearing or saving
+ * is just moving start up to journal_w. Whatever is left on the next
+ * start was never saved and is written out again by journal_recover().
+ */
+#define JOURNAL_FILE "vcs_keyboard.journal"
+#define JOURNAL_MAGIC "VCSJRNL2"
+#define JOURNAL_SAMPLES (1 << 25)   /* about 17 minutes, the longest recording, power of two */
+#define JOURNAL_NOTES (1 << 16)     /* power of two */
+#define JOURNAL_PAGE 4096
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_AHEAD (FREQ*3)      /* samples ahead of the write head kept faulted in */
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+/* further down in main.cpp */
+static void write_wav(string base, const vector<int16_t> &rec);
+static void write_audacity(string base);
+static void write_asm(string base);
+static void write_asm_patterns(string base, float end);
+
+struct journal_header {
+    char magic[8];
+    int32_t T, number;
+    uint32_t audcmask;              /* audcSet as a bit mask, names the files */
+    uint32_t pad;
+    uint64_t nsamples;              /* samples synced to disk, flush thread only */
+    uint64_t start;                 /* first sample of the current recording */
+    uint64_t nnotes;                /* notes in the current recording */
+};
+
+struct journal_note {
+    float t;
+    int32_t type, freq;
+    char binary[16], note[16];
+};
+
+struct journal_layout {
+    char header[JOURNAL_PAGE];
+    journal_note notes[JOURNAL_NOTES];
+    int16_t samples[JOURNAL_SAMPLES];
+};
+
+static journal_layout *journal = NULL;
+static bool journal_mapped = false;
+static volatile uint64_t journal_w = 0; /* samples ever written, audio thread only */
+static uint64_t journal_synced = 0;     /* flush thread only */
+static uint64_t journal_touched = 0;    /* flush thread only */
+#define JH ((journal_header*)journal->header)
+
+/* writes the pages under [p, p+len) to disk */
+static void journal_sync(const void *p, size_t len) {
+    uintptr_t a = (uintptr_t)p & ~(uintptr_t)(JOURNAL_PAGE-1);
+
+#ifdef WIN32
+    FlushViewOfFile((void*)a, len + ((uintptr_t)p - a));
+#else
+    msync((void*)a, len + ((uintptr_t)p - a), MS_SYNC);
+#endif
+}
+
+/**
+ * Faults in the JOURNAL_AHEAD samples after w for writing. Adding 0
+ * atomically changes nothing even if the audio thread gets there first.
+ */
+static void journal_touch(uint64_t w) {
+    journal_touched = max(journal_touched, w & ~(uint64_t)(JOURNAL_PAGE/2 - 1));
+
+    for (; journal_touched < w + JOURNAL_AHEAD; journal_touched += JOURNAL_PAGE/2) {
+        int32_t *p = (int32_t*)&journal->samples[journal_touched & (JOURNAL_SAMPLES-1)];
+#ifdef WIN32
+        InterlockedExchangeAdd((volatile LONG*)p, 0);
+#else
+        __sync_fetch_and_add(p, 0);
+#endif
+    }
+}
+
+static void journal_flush() {
+    //whole pages only, the one under the write head is still being written
+    uint64_t w = journal_w & ~(uint64_t)(JOURNAL_PAGE/2 - 1);
+
+    memory_barrier();
+
+    if (w - journal_synced > JOURNAL_SAMPLES)
+        journal_synced = w - JOURNAL_SAMPLES;
+
+    while (journal_synced < w) {
+        size_t pos = journal_synced & (JOURNAL_SAMPLES-1);
+        size_t n = min(w - journal_synced, (uint64_t)(JOURNAL_SAMPLES - pos));
+
+        journal_sync(&journal->samples[pos], n*2);
+        journal_synced += n;
+    }
+
+    //only claim the samples once they're on disk
+    JH->nsamples = w;
+    journal_sync(journal, offsetof(journal_layout, samples));
+
+    //writeback write protects the pages it cleans, get the next ones ready again
+    journal_touch(w);
+}
+
+static int journal_thread(void *unused) {
+    for (;;) {
+        SDL_Delay(JOURNAL_FLUSH_MS);
+        journal_flush();
+    }
+
+    return 0;
+}
+
+static bool journal_open() {
+#ifdef WIN32
+    HANDLE file = CreateFileA(JOURNAL_FILE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    //sizing the mapping allocates the file, it isn't sparse unless asked to be
+    HANDLE map = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, sizeof(journal_layout), NULL);
+    if (!map)
+        return false;
+
+    journal = (journal_layout*)MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(journal_layout));
+    return journal != NULL;
+#else
+    int fd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    char magic[8];
+
+    if (fd < 0)
+        return false;
+
+    /* a new or foreign file is written out now, one page at a time. With
+       posix_fallocate() or bigger writes (large folios in the page cache)
+       syncing the pages behind the write head also wrote back the ones
+       journal_touch() got ready ahead of it, and the callback faulted on
+       every page again */
+    if (pread(fd, magic, 8, 0) != 8 || memcmp(magic, JOURNAL_MAGIC, 8) || lseek(fd, 0, SEEK_END) < (off_t)sizeof(journal_layout)) {
+        vector<char> zero(JOURNAL_PAGE);
+
+        for (size_t x = 0; x < sizeof(journal_layout); x += zero.size())
+            if (pwrite(fd, &zero[0], min(zero.size(), sizeof(journal_layout) - x), x) < 0) {
+                close(fd);
+                return false;
+            }
+
+        fsync(fd);
+    }
+
+    void *p = mmap(NULL, sizeof(journal_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED)
+        return false;
+
+    journal = (journal_layout*)p;
+    return true;
+#endif
+}
+
+static void journal_note_add(const mark &m) {
+    journal_note &jn = journal->notes[JH->nnotes & (JOURNAL_NOTES-1)];
+
+    jn.t = m.t;
+    jn.type = m.type;
+    jn.freq = m.freq;
+    snprintf(jn.binary, sizeof(jn.binary), "%s", m.binary.c_str());
+    snprintf(jn.note, sizeof(jn.note), "%s", m.note.c_str());
+
+    JH->audcmask |= 1 << typetab[m.type];
+    memory_barrier();
+    JH->nnotes++;
+}
+
+/* samples in the current recording */
+static uint64_t journal_length() {
+    return journal_w - JH->start;
+}
+
+/**
+ * Starts recording number num; everything before is saved or thrown away.
+ * Call it with the audio locked so the cut lands on the same sample as
+ * the encoders'.
+ */
+static void journal_reset(int num) {
+    JH->T = T;
+    JH->number = num;
+    JH->nnotes = 0;
+
+    //audcSet lives on across Enter, so the mask has to as well
+    JH->audcmask = 0;
+    for (set<int>::iterator it = audcSet.begin(); it != audcSet.end(); it++)
+        JH->audcmask |= 1 << *it;
+
+    memory_barrier();
+    JH->start = journal_w;
+}
+
+/**
+ * Copies samples [start, end) out of the ring into rec. A recording longer
+ * than the ring has lost its beginning, so that is left out and notes are
+ * moved to match.
+ */
+static void journal_copy(uint64_t start, uint64_t end, vector<int16_t> &rec) {
+    uint64_t kept = min(end - start, (uint64_t)JOURNAL_SAMPLES);
+    float dropped = (end - start - kept) / (float)FREQ;
+
+    rec.resize(kept);
+
+    for (uint64_t x = end - kept; x < end;) {
+        size_t pos = x & (JOURNAL_SAMPLES-1);
+        size_t n = min(end - x, (uint64_t)(JOURNAL_SAMPLES - pos));
+
+        memcpy(&rec[x - (end - kept)], &journal->samples[pos], n*2);
+        x += n;
+    }
+
+    if (!dropped)
+        return;
+
+    printf("The recording is longer than the journal, lost the first %.1f seconds\n", dropped);
+
+    vector<mark> keep;
+    for (size_t x = 0; x < notes.size(); x++)
+        if (notes[x].t >= dropped) {
+            keep.push_back(notes[x]);
+            keep.back().t -= dropped;
+        }
+
+    notes.swap(keep);
+}
+
+/* writes out whatever the last session didn't save, using the usual names */
+static void journal_recover() {
+    uint64_t end = max(JH->nsamples, JH->start);
+    uint64_t nn = min(JH->nnotes, (uint64_t)JOURNAL_NOTES);
+    int myT = T, mynumber = number;
+    vector<int16_t> rec;
+    uint64_t x;
+
+    //nothing was played since the last save or clear
+    if (!JH->nnotes || !JH->audcmask)
+        return;
+
+    printf("Recovering %li samples and %li notes from %s\n", (long)min(end - JH->start, (uint64_t)JOURNAL_SAMPLES), (long)nn, JOURNAL_FILE);
+
+    for (x = JH->nnotes - nn; x < JH->nnotes; x++) {
+        const journal_note &jn = journal->notes[x & (JOURNAL_NOTES-1)];
+        mark m;
+
+        m.t = jn.t;
+        m.type = jn.type;
+        m.freq = jn.freq;
+        m.binary = jn.binary;
+        m.note = jn.note;
+        notes.push_back(m);
+    }
+
+    journal_copy(JH->start, end, rec);
+
+    ostringstream oss;
+    for (int c = 0; c < 16; c++)
+        if (JH->audcmask & (1 << c))
+            oss << c << "-";
+
+    T = JH->T;
+    number = JH->number;
+    write_wav(oss.str(), rec);
+    write_audacity(oss.str());
+    write_asm(oss.str());
+    write_asm_patterns(oss.str(), rec.size() / (float)FREQ);
+
+    T = myT;
+    number = mynumber;
+    notes.clear();
+}
+
+static void journal_init() {
+    journal_mapped = journal_open();
+
+    if (!journal_mapped) {
+        printf("Couldn't map %s, running without a journal\n", JOURNAL_FILE);
+        journal = (journal_layout*)calloc(1, sizeof(journal_layout));
+    }
+
+    if (journal_mapped && !memcmp(JH->magic, JOURNAL_MAGIC, 8))
+        journal_recover();
+    else {
+        memset(JH, 0, sizeof(journal_header));
+        memcpy(JH->magic, JOURNAL_MAGIC, 8);
+    }
+
+    //carry on after the last session so a crash during this one can't mix them up
+    journal_w = journal_synced = journal_touched = JH->nsamples;
+    journal_reset(number);
+
+    if (journal_mapped) {
+        journal_touch(journal_w);
+        SDL_CreateThread(journal_thread, NULL);
+    }
+}
@@ -1,5 +1,7 @@
 #include <SDL/SDL.h>
 #include <SDL/SDL_audio.h>
+#include <SDL/SDL_thread.h>
+#include <SDL/SDL_mutex.h>
 #include <stdio.h>
 #include <time.h>
 #ifdef WIN32
@@ -11,26 +13,89 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <map>
+#include <algorithm>
 #include <sstream>
+#include <stdlib.h>
+#include <math.h>
 
 using namespace std;
 
 #define FREQ 31400
-#define C 32
+#define MAX_C 1024
+#define GROUP 32                  /* channels per render group, one AUDF 0..31 bank */
+#define MAX_BLOCK 1024            /* most samples rendered per pool_run() */
+
+static int C = 32;                /* number of channels, see -c */
 
 #include "tables.c"
 
-static int counters[C] = {0};
+static int counters[MAX_C] = {0};
 
 //code mostly ripped from Stella
-static uint8_t myAUDC[C] = {0};
-static uint8_t myAUDF[C] = {0};
-static int myAUDV[C] = {0};
-static uint8_t myP4[C];           // 4-bit register LFSR (lower 4 bits used)
-static uint8_t myP5[C];           // 5-bit register LFSR (lower 5 bits used)
+static uint8_t myAUDC[MAX_C] = {0};
+static uint8_t myAUDF[MAX_C] = {0};
+static int myAUDV[MAX_C] = {0};
+static uint8_t myP4[MAX_C];       // 4-bit register LFSR (lower 4 bits used)
+static uint8_t myP5[MAX_C];       // 5-bit register LFSR (lower 5 bits used)
+static uint32_t myStep[MAX_C];    // TIA clocks per output sample, 16.16 fixed point
+static uint32_t myPhase[MAX_C];   // fraction of a clock carried over to the next sample
+static float detune = 3;          /* cents between neighbouring banks, see -d */
 static set<int> audcSet;          //AUDC values present in the current recording
 
+#include "blep.c"
 #include "tiasnd.c"
+#include "pool.c"
+
+/* orders the writes to a ring before the index that hands them to another thread */
+static inline void memory_barrier() {
+#ifdef WIN32
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+static int groupmix[MAX_C/GROUP][MAX_BLOCK];
+
+static void render_group(int g, void *arg) {
+    int n = *(int*)arg;
+    int c1 = (g+1)*GROUP < C ? (g+1)*GROUP : C;
+
+    memset(groupmix[g], 0, n*sizeof(int));
+
+    if (blep)
+        memset(blep_res[g], 0, (n + BLEP_TAPS)*sizeof(float));
+
+    render_channels(g*GROUP, c1, groupmix[g], blep ? blep_res[g] : NULL, n);
+}
+
+/**
+ * Renders n <= MAX_BLOCK samples into mix. Each group of channels is one job
+ * for the pool. The partial mixes are summed in group order afterwards, so
+ * the output is the same whatever the number of threads.
+ */
+static void render_block(int *mix, int n) {
+    int x, g, groups = (C + GROUP - 1) / GROUP;
+
+    pool_run(render_group, groups, &n);
+
+    for (x = 0; x < n; x++) {
+        int sum = 0;
+
+        for (g = 0; g < groups; g++)
+            sum += groupmix[g][x];
+
+        mix[x] = sum;
+    }
+
+    if (blep)
+        blep_mix(mix, groups, n);
+
+    //scale down so that each extra bank doesn't push us further into wraparound
+    for (x = 0; x < n; x++)
+        mix[x] /= groups;
+}
 
 struct mark {
     float t;
@@ -39,22 +104,30 @@ struct mark {
 };
 
 static vector<mark> notes;
-static vector<int16_t> samples;
 static int T;                   /* when the program was started */
 static int number = 0;
 #define FPS 50
 static int frame = 0;
 
+#include "journal.c"
+#include "flac.c"
+#include "tiaz.c"
+#include "encoder.c"
+#include "fft.c"
+#include "view.c"
+#include "tuning.c"
+
 static void sprint_note(int type, int freq, char *out) {
-    //TODO: we need a lengthy table for this..
-    int t = audcnotesnamemap[typetab[type]];
+    //notedesc only has PAL and misses some tones, -analyse makes a complete table for -notes
+    const char *name;
+    int tuning;
 
-    if (t < 0 || !notedesc[t][freq].name[0]) strcpy(out, "");
-    else       sprintf(out, "%-3s %-+3i", notedesc[t][freq].name, notedesc[t][freq].tuning);
+    if (!lookup_note(typetab[type], freq, &name, &tuning)) strcpy(out, "");
+    else       sprintf(out, "%-3s %-+3i", name, tuning);
 }
 
-static void sprint_binary(int freq, char *out) {
-    int c = myAUDC[freq];
+static void sprint_binary(int type, int freq, char *out) {
+    int c = typetab[type];
     int bits = slocumtab[c];
     char temp[5];
 
@@ -66,12 +139,35 @@ static void sprint_binary(int freq, char *out) {
     sprintf(out, "%s%i%i%i%i%i", temp, (freq >> 4) & 1, (freq >> 3) & 1, (freq >> 2) & 1, (freq >> 1) & 1, freq & 1);
 }
 
+static volatile int late = 0;     /* callbacks that took longer than the audio they rendered */
+
 static void synth(void *unused, Uint8 *stream, int len) {
     int16_t *s16 = (int16_t*)stream;
-    int x;
+    int mix[MAX_BLOCK];
+    int x, n;
+    Uint32 t0 = SDL_GetTicks(), ms = len/2 * 1000 / FREQ;
+
+    for (; len > 0; len -= n*2, s16 += n) {
+        uint64_t w = journal_w;
+        size_t pos = w & (JOURNAL_SAMPLES-1);
+        int16_t *rec = &journal->samples[pos];
+
+        //the recording is the journal's ring, a block stops where it wraps
+        n = len/2 < MAX_BLOCK ? len/2 : MAX_BLOCK;
+        n = n < (int)(JOURNAL_SAMPLES - pos) ? n : (int)(JOURNAL_SAMPLES - pos);
+        render_block(mix, n);
+
+        for (x = 0; x < n; x++)
+            rec[x] = s16[x] = mix[x];
+
+        memory_barrier();
+        journal_w = w + n;
+        enc_push(w, w + n);
+    }
 
-    for (x = 0; x < len/2; x++)
-        samples.push_back(s16[x] = next_tia_sample());
+    //SDL_GetTicks() is only good to a millisecond, so only count clear misses
+    if (SDL_GetTicks() - t0 > ms)
+        late++;
 }
 
 static void setAUDC(int c) {
@@ -93,15 +189,15 @@ static void write_l32(FILE *f, uint32_t a) {
     putc(a>>24, f);
 }
 
-static void write_wav(string base) {
+static void write_wav(string base, const vector<int16_t> &rec) {
     char name[256];
 
     sprintf(name, "%s%i-%i.wav", base.c_str(), T, number);
-    printf("Writing %li sample WAV to %s\n", samples.size(), name);
+    printf("Writing %li sample WAV to %s\n", rec.size(), name);
 
     FILE *wav = fopen(name, "wb");
     fprintf(wav, "RIFF");
-    write_l32(wav, samples.size()*2 + 36);
+    write_l32(wav, rec.size()*2 + 36);
     fprintf(wav, "WAVEfmt ");
     write_l32(wav, 16);
     write_l32(wav, 0x00010001);
@@ -109,8 +205,8 @@ static void write_wav(string base) {
     write_l32(wav, FREQ*2);
     write_l32(wav, 0x00100002);
     fprintf(wav, "data");
-    write_l32(wav, samples.size()*2);
-    fwrite(&samples[0], samples.size()*2, 1, wav);
+    write_l32(wav, rec.size()*2);
+    fwrite(&rec[0], rec.size()*2, 1, wav);
     fclose(wav);
 }
 
@@ -142,6 +238,9 @@ static void write_asm(string base) {
     fclose(as);
 }
 
+#include "patterns.c"
+#include "transcribe.c"
+
 static int curkeymap = 0;
 
 static void print_keymap() {
@@ -150,9 +249,22 @@ static void print_keymap() {
 
 static void print_help() {
     print_keymap();
+    printf(
+        "Usage: vcs_keyboard [-c channels] [-d cents] [-t threads] [-b] [-transcribe file.wav] [-type audc] [-analyse] [-notes file]\n"
+        "  -c  number of channels, in banks of 32 (AUDF 0..31 each, default 32, max %i)\n"
+        "  -d  detune in cents between banks (default 3), spread evenly around the true pitch\n"
+        "  -t  number of threads to render the banks on (default 1)\n"
+        "  -b  band-limited steps at every channel edge, less aliasing on high and detuned notes\n"
+        "  -transcribe  pitch track a WAV into Audacity labels and ASM data, then exit\n"
+        "  -type  only transcribe to this AUDC (default the pure tones 4, 6, 12 and 14)\n"
+        "  -analyse  measure every AUDC/AUDF, write notes-pal.txt and notes-ntsc.txt, then exit\n"
+        "  -notes  load note names and tunings from a file written by -analyse\n"
+        "\n", MAX_C
+    );
     printf(
         "Keypad 0-9 and page up/down changes sound type\n"
-        "Press 'enter' to save what you've played (WAV, Audacity labels and ASM data)\n"
+        "Keypad +/- zooms the recording overview in on the end of the recording and back out\n"
+        "Press 'enter' to save what you've played (WAV, FLAC, TIAZ, Audacity labels, ASM data and ASM patterns)\n"
         "Press 'space' to clear the current recording\n"
         "\n"
     );
@@ -173,20 +285,78 @@ int main(int argc, char **argv) {
     int x;
     char name[256];
     int curtype = 3;
+    int threads = 1;
+    const char *transcribe_wav = NULL;
+    int analyse = 0;
+    int late_shown = 0;
+    Uint32 late_time = 0;
 
     SDL_AudioSpec fmt;
     SDL_Event event;
 
+    for (x = 1; x < argc; x++) {
+        if (!strcmp(argv[x], "-c") && x+1 < argc)
+            C = atoi(argv[++x]);
+        else if (!strcmp(argv[x], "-d") && x+1 < argc)
+            detune = atof(argv[++x]);
+        else if (!strcmp(argv[x], "-t") && x+1 < argc)
+            threads = atoi(argv[++x]);
+        else if (!strcmp(argv[x], "-b"))
+            blep = 1;
+        else if (!strcmp(argv[x], "-transcribe") && x+1 < argc)
+            transcribe_wav = argv[++x];
+        else if (!strcmp(argv[x], "-type") && x+1 < argc)
+            tr_audc = atoi(argv[++x]);
+        else if (!strcmp(argv[x], "-analyse"))
+            analyse = 1;
+        else if (!strcmp(argv[x], "-notes") && x+1 < argc) {
+            if (!load_tuning(argv[++x])) {
+                printf("Couldn't read any tunings from %s\n", argv[x]);
+                return 1;
+            }
+        }
+        else {
+            print_help();
+            return 1;
+        }
+    }
+
+    //whole banks only, a partial bank would play some notes quieter than others
+    C = (C + GROUP - 1) / GROUP * GROUP;
+    if (C < GROUP) C = GROUP;
+    if (C > MAX_C) C = MAX_C;
+
     print_help();
     T = time(NULL);
+    pool_init(threads);
+
+    if (analyse)
+        return analyse_tuning();
+
+    if (transcribe_wav)
+        return transcribe(transcribe_wav);
 
-    /* need a window for the keyboard to work */
-    SDL_SetVideoMode(320, 240, 0, 0);
+    blep_init();
+    journal_init();
+    enc_init();
+
+    /* need a window for the keyboard to work, and we might as well draw in it */
+    view_init(SDL_SetVideoMode(VIEW_W, VIEW_PANEL*VIEW_PANELS, 0, SDL_SWSURFACE));
 
     setAUDC(typetab[curtype]);
 
-    for (x = 0; x < C; x++)
-        myAUDF[x] = x;
+    /* every bank gets its own clock and starting state, or they would all
+       render the same samples and adding them up would gain nothing.
+       An all zero LFSR is reloaded with 1, so bank 0 starts as before */
+    for (x = 0; x < C; x++) {
+        int bank = x / GROUP, banks = C / GROUP;
+
+        myAUDF[x] = x % GROUP;
+        myStep[x] = (uint32_t)(0x10000 * pow(2, (bank - (banks - 1) / 2.0) * detune / 1200) + 0.5);
+        myP4[x] = bank % 16;
+        myP5[x] = bank % 32;
+        counters[x] = bank % (myAUDF[x]*2 + 2);
+    }
 
     fmt.freq = FREQ;
     fmt.format = AUDIO_S16;
@@ -205,7 +375,7 @@ int main(int argc, char **argv) {
     SDL_PauseAudio(0);
 
     for(;;) {
-        float t = samples.size() / (float)FREQ;
+        float t = journal_length() / (float)FREQ;
         int f = t * FPS;
 
         if (f != frame) {
@@ -230,21 +400,43 @@ int main(int argc, char **argv) {
                     if (event.key.keysym.sym == SDLK_SPACE) {
                         /* clear */
                         printf("Recording cleared\n");
-                        samples.clear();
-                        notes.clear();
                         audcSet.clear();
+
+                        //with the audio locked, the recording and encoders stop at the same sample
+                        SDL_LockAudio();
+                        enc_post(ENC_CLEAR, "");
+                        journal_reset(number);
+                        SDL_UnlockAudio();
+                        enc_wait();
+
+                        view_clear();
+                        notes.clear();
                     } else if (event.key.keysym.sym == SDLK_RETURN) {
-                        if (audcSet.size()) {
-                            ostringstream oss;
-                            for (set<int>::iterator it = audcSet.begin(); it != audcSet.end(); it++)
-                                oss << *it << "-";
+                        vector<int16_t> rec;
+                        uint64_t start, end;
+                        ostringstream oss;
+                        for (set<int>::iterator it = audcSet.begin(); it != audcSet.end(); it++)
+                            oss << *it << "-";
+
+                        //cut everything at the same sample, the audio carries on into the next recording
+                        SDL_LockAudio();
+                        start = JH->start;
+                        end = journal_w;
+                        enc_post(audcSet.size() ? ENC_FINISH : ENC_CLEAR, enc_name(oss.str()));
+                        journal_reset(number + 1);
+                        SDL_UnlockAudio();
 
-                            write_wav(oss.str());
+                        if (audcSet.size()) {
+                            journal_copy(start, end, rec);
+                            write_wav(oss.str(), rec);
+                            write_compressed(oss.str(), rec);
                             write_audacity(oss.str());
                             write_asm(oss.str());
-                        }
+                            write_asm_patterns(oss.str(), rec.size() / (float)FREQ);
+                        } else
+                            enc_wait();
 
-                        samples.clear();
+                        view_clear();
                         notes.clear();
                         number++;
                     } else if (event.key.keysym.sym >= SDLK_KP0 && event.key.keysym.sym <= SDLK_KP9) {
@@ -259,6 +451,10 @@ int main(int argc, char **argv) {
                     } else if (event.key.keysym.sym == SDLK_END) {
                         curkeymap = (curkeymap + 1) % num_keymaps;
                         print_keymap();
+                    } else if (event.key.keysym.sym == SDLK_KP_PLUS) {
+                        if (view_zoom < 20) view_zoom++;
+                    } else if (event.key.keysym.sym == SDLK_KP_MINUS) {
+                        if (view_zoom > 0) view_zoom--;
                     }
                 }
 
@@ -272,8 +468,9 @@ int main(int argc, char **argv) {
                             m.t = t;
                             audcSet.insert(typetab[curtype]);
 
-                            myAUDV[m.freq] = 8000;
-                            sprint_binary(m.freq, temp);
+                            for (int c = m.freq; c < C; c += GROUP)
+                                myAUDV[c] = 8000;
+                            sprint_binary(m.type, m.freq, temp);
 
                             printf("%s ", temp);
                             m.binary = temp;
@@ -283,13 +480,24 @@ int main(int argc, char **argv) {
                             m.note = temp;
 
                             notes.push_back(m);
-                        } else
-                            myAUDV[keymaps[curkeymap].map[x].freq] = 7000;
+                            journal_note_add(m);
+                        } else {
+                            for (int c = keymaps[curkeymap].map[x].freq; c < C; c += GROUP)
+                                myAUDV[c] = 7000;
+                        }
                     }
             } else if (event.type == SDL_QUIT)
                 goto die;
         }
 
+        if (late != late_shown && SDL_GetTicks() - late_time >= 1000) {
+            printf("Missed %i audio deadlines, try fewer channels (-c) or more threads (-t)\n", late - late_shown);
+            late_shown = late;
+            late_time = SDL_GetTicks();
+        }
+
+        view_update();
+
 #ifdef WIN32
         Sleep(10);
 #else
@@ -297,5 +505,8 @@ int main(int argc, char **argv) {
 #endif
     }
 die:
+    enc_clear();
+    //quitting on purpose throws the recording away, same as without the journal
+    journal_reset(number);
     return 0;
 }
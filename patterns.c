@@ -0,0 +1,220 @@
+/**
+ * Pattern based ASM export laid out the way Slocum's player walks its
+ * songs. The notes are turned into (note, duration) pairs and the
+ * sequence is cut into patterns of at most L notes. Whenever the next L
+ * notes are the same as a pattern we already have, the order list points
+ * at that pattern instead of storing the notes again. Candidate windows
+ * are found with a rolling hash, so each pattern length is one pass over
+ * the notes.
+ *
+ * Note bytes are %TTTFFFFF with the player's sound types from slocumtab.
+ * The order list is one byte per entry, ended by PAT_END, and indexes the
+ * split PatternArrayL/PatternArrayH pointer tables. Each pattern is a
+ * length byte followed by note/duration byte pairs; the player's own
+ * patterns run at a fixed tempo, which a freely played recording doesn't
+ * have, so the durations in frames are kept. A duration of PAT_HOLD holds
+ * the previous note for another 255 frames without retriggering it.
+ *
+ * With PAT_END or more patterns a byte can't index them, and the order
+ * list falls back to pattern pointers ended by a zero word. Every pattern
+ * length in patlens[] is tried and the smallest result is written.
+ */
+#define PAT_END 255
+#define PAT_HOLD 0
+static const int patlens[] = {4, 8, 16, 32, 64};
+
+struct patsong {
+    vector<vector<int> > patterns;  /* token sequences */
+    vector<int> order;              /* pattern indices */
+
+    /* byte indices into the pointer tables, or pointers in the order list */
+    bool narrow() const {
+        return patterns.size() < PAT_END;
+    }
+
+    int bytes() const {
+        int ret = narrow() ? order.size() + 1 + patterns.size()*2 : order.size()*2 + 2;
+
+        for (size_t x = 0; x < patterns.size(); x++)
+            ret += 1 + patterns[x].size()*2;
+
+        return ret;
+    }
+};
+
+static int add_pattern(patsong &song, map<vector<int>, int> &known, const int *tokens, int len) {
+    vector<int> p(tokens, tokens + len);
+    map<vector<int>, int>::iterator it = known.find(p);
+
+    if (it != known.end())
+        return it->second;
+
+    song.patterns.push_back(p);
+    return known[p] = song.patterns.size() - 1;
+}
+
+static patsong build_patterns(const vector<int> &tokens, int L) {
+    const uint64_t B = 1000003;
+    int n = tokens.size(), lit = 0, i = 0, k;
+    uint64_t h = 0, BL = 1;     /* BL = B^(L-1) */
+    patsong song;
+    map<vector<int>, int> known;
+    multimap<uint64_t, int> byhash;     /* full length patterns by hash */
+
+    for (k = 1; k < L; k++)
+        BL *= B;
+
+    for (k = 0; k < L && k < n; k++)
+        h = h*B + tokens[k];
+
+    while (i + L <= n) {
+        int match = -1;
+        pair<multimap<uint64_t, int>::iterator, multimap<uint64_t, int>::iterator> r = byhash.equal_range(h);
+
+        for (multimap<uint64_t, int>::iterator it = r.first; it != r.second && match < 0; it++)
+            if (equal(tokens.begin() + i, tokens.begin() + i + L, song.patterns[it->second].begin()))
+                match = it->second;
+
+        if (match >= 0) {
+            //flush what we have so far, then reuse the pattern
+            if (lit < i)
+                song.order.push_back(add_pattern(song, known, &tokens[lit], i - lit));
+
+            song.order.push_back(match);
+            i += L;
+            lit = i;
+
+            for (h = 0, k = 0; k < L && i + k < n; k++)
+                h = h*B + tokens[i+k];
+
+            continue;
+        }
+
+        if (i + L < n)
+            h = (h - tokens[i]*BL)*B + tokens[i+L];
+
+        if (++i - lit == L) {
+            int p = add_pattern(song, known, &tokens[lit], L);
+
+            //the window starting at lit is what this pattern's hash is
+            uint64_t ph = 0;
+            for (k = 0; k < L; k++)
+                ph = ph*B + tokens[lit+k];
+
+            byhash.insert(make_pair(ph, p));
+            song.order.push_back(p);
+            lit = i;
+        }
+    }
+
+    //whatever is left is shorter than L and goes in as is
+    for (; lit < n; lit += L)
+        song.order.push_back(add_pattern(song, known, &tokens[lit], min(L, n - lit)));
+
+    return song;
+}
+
+/* end is the length of the recording in seconds, which the last note lasts until */
+static void write_asm_patterns(string base, float end) {
+    char name[256];
+    vector<int> tokens;
+    vector<size_t> first;           /* first note with each token, for comments */
+    vector<int> durs;               /* duration of each token, PAT_HOLD for a hold */
+    map<pair<pair<string, int>, int>, int> ids;
+    size_t x, y;
+    int frame = notes.size() ? (int)(notes[0].t * FPS + 0.5f) : 0;
+
+    sprintf(name, "%s%i-%i-patterns.asm", base.c_str(), T, number);
+    printf("Writing ASM patterns to %s\n", name);
+
+    for (x = 0; x < notes.size(); x++) {
+        /* frames until the next note, or the end of the recording. Rounding
+           where each note starts rather than each duration keeps the
+           rounding errors from adding up over the song */
+        float next = x + 1 < notes.size() ? notes[x+1].t : end;
+        int nextframe = max((int)(next * FPS + 0.5f), frame + 1);
+        int dur = nextframe - frame, holds = (dur - 1) / 255;
+
+        frame = nextframe;
+
+        //the note itself, then holds of 255 frames for whatever doesn't fit in a byte
+        for (int h = 0; h <= holds; h++) {
+            int d = h ? PAT_HOLD : dur - 255*holds;
+            pair<pair<string, int>, int> key(make_pair(notes[x].binary, notes[x].type), d);
+            map<pair<pair<string, int>, int>, int>::iterator it = ids.find(key);
+
+            if (it == ids.end()) {
+                it = ids.insert(make_pair(key, (int)first.size())).first;
+                first.push_back(x);
+                durs.push_back(d);
+            }
+
+            tokens.push_back(it->second);
+        }
+    }
+
+    patsong best;
+    int bestlen = 0;
+
+    for (x = 0; x < sizeof(patlens)/sizeof(*patlens); x++) {
+        patsong song = build_patterns(tokens, patlens[x]);
+
+        if (!bestlen || song.bytes() < best.bytes()) {
+            best = song;
+            bestlen = patlens[x];
+        }
+    }
+
+    FILE *as = fopen(name, "w");
+
+    fprintf(as, "; patterns for Slocum's player with durations in frames, see patterns.c\n");
+    fprintf(as, "; %i notes in %i entries, %i bytes unpatterned\n", (int)notes.size(), (int)tokens.size(), (int)tokens.size()*2);
+    fprintf(as, "; %i patterns of at most %i notes, %i order entries, %i bytes\n\n",
+        (int)best.patterns.size(), bestlen, (int)best.order.size(), best.bytes());
+
+    for (x = 0; x < best.patterns.size(); x++) {
+        fprintf(as, "Pattern%i\n", (int)x);
+        fprintf(as, "\t.byte %i\n", (int)best.patterns[x].size());
+
+        for (y = 0; y < best.patterns[x].size(); y++) {
+            int tok = best.patterns[x][y];
+            const mark &m = notes[first[tok]];
+
+            if (durs[tok] == PAT_HOLD)
+                fprintf(as, "\t.byte %s,%i\t; hold\n", m.binary.c_str(), PAT_HOLD);
+            else
+                fprintf(as, "\t.byte %s,%i\t; %s\n", m.binary.c_str(), durs[tok], m.note.c_str());
+        }
+    }
+
+    if (best.narrow()) {
+        fprintf(as, "\nPatternArrayL\n");
+
+        for (x = 0; x < best.patterns.size(); x++)
+            fprintf(as, "\t.byte <Pattern%i\n", (int)x);
+
+        fprintf(as, "\nPatternArrayH\n");
+
+        for (x = 0; x < best.patterns.size(); x++)
+            fprintf(as, "\t.byte >Pattern%i\n", (int)x);
+
+        fprintf(as, "\nOrder\n");
+
+        for (x = 0; x < best.order.size(); x++)
+            fprintf(as, "\t.byte %i\n", best.order[x]);
+
+        fprintf(as, "\t.byte %i\n", PAT_END);
+    } else {
+        fprintf(as, "\nOrder\n");
+
+        for (x = 0; x < best.order.size(); x++)
+            fprintf(as, "\t.word Pattern%i\n", best.order[x]);
+
+        fprintf(as, "\t.word 0\n");
+    }
+
+    fclose(as);
+
+    printf("%i notes: %i bytes unpatterned, %i bytes in %i patterns of at most %i notes\n",
+        (int)notes.size(), (int)tokens.size()*2, best.bytes(), (int)best.patterns.size(), bestlen);
+}
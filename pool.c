@@ -0,0 +1,86 @@
+/**
+ * Persistent worker pool. The threads are created once at startup and
+ * parked on a semaphore, so handing them work from the audio callback
+ * costs a couple of semaphore posts instead of thread creation.
+ *
+ * pool_run() hands out job indices 0..njobs-1 to the workers and the
+ * calling thread alike and returns once every job has finished. Which
+ * thread runs which job is not defined, so jobs must write to their own
+ * slot of the output and leave any reduction to the caller.
+ */
+#define MAX_THREADS 64
+
+typedef void (*pool_job)(int job, void *arg);
+
+static int num_threads = 1;         /* including the calling thread */
+static SDL_sem *pool_wake[MAX_THREADS];
+static SDL_sem *pool_done;
+static SDL_mutex *pool_lock;
+static pool_job pool_fn;
+static void *pool_arg;
+static int pool_next, pool_njobs;
+
+static int pool_take() {
+    int job;
+
+    SDL_LockMutex(pool_lock);
+    job = pool_next < pool_njobs ? pool_next++ : -1;
+    SDL_UnlockMutex(pool_lock);
+
+    return job;
+}
+
+static void pool_work() {
+    int job;
+
+    while ((job = pool_take()) >= 0)
+        pool_fn(job, pool_arg);
+}
+
+static int pool_thread(void *data) {
+    SDL_sem *wake = (SDL_sem*)data;
+
+    for (;;) {
+        SDL_SemWait(wake);
+        pool_work();
+        SDL_SemPost(pool_done);
+    }
+
+    return 0;
+}
+
+static void pool_init(int threads) {
+    int x;
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    num_threads = threads;
+
+    pool_done = SDL_CreateSemaphore(0);
+    pool_lock = SDL_CreateMutex();
+
+    for (x = 1; x < num_threads; x++) {
+        pool_wake[x] = SDL_CreateSemaphore(0);
+        SDL_CreateThread(pool_thread, pool_wake[x]);
+    }
+}
+
+static void pool_run(pool_job fn, int njobs, void *arg) {
+    int x, workers = num_threads - 1;
+
+    if (workers > njobs - 1)
+        workers = njobs - 1;
+
+    pool_fn = fn;
+    pool_arg = arg;
+    pool_next = 0;
+    pool_njobs = njobs;
+
+    for (x = 1; x <= workers; x++)
+        SDL_SemPost(pool_wake[x]);
+
+    pool_work();
+
+    for (x = 1; x <= workers; x++)
+        SDL_SemWait(pool_done);
+}
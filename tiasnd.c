@@ -1,8 +1,5 @@
-static int next_tia_sample() {
-    int c, ret = 0;
-
-    // Process both sound channels
-    for (c = 0; c < C; c++)
+//clocks channel c once and returns its output level
+static inline int next_tia_sample(int c) {
     {
       // Update P4 & P5 registers for channel if freq divider outputs a pulse
       if (++counters[c] >= myAUDF[c]*2+2)
@@ -206,9 +203,56 @@ static int next_tia_sample() {
           }
         }
       }
-
-      ret += (myP4[c] & 8) ? myAUDV[c] : 0;
     }
 
-    return ret;
+    return (myP4[c] & 8) ? myAUDV[c] : 0;
+}
+
+/**
+ * Adds n samples of channels c0..c1-1 to out, clocking each at its myStep.
+ * If res isn't NULL, every change of level also gets a band-limited step
+ * residual added to res, which has to hold n + BLEP_TAPS samples.
+ */
+static void render_channels(int c0, int c1, int *out, float *res, int n) {
+    int c, x;
+
+    for (c = c0; c < c1; c++) {
+        uint32_t step = myStep[c], phase = myPhase[c];
+        int v = (myP4[c] & 8) ? myAUDV[c] : 0;
+
+        if (res) {
+            for (x = 0; x < n; x++) {
+                for (phase += step; phase >= 0x10000; phase -= 0x10000) {
+                    int nv = next_tia_sample(c);
+
+                    //the clock ticked (phase - 1) / step of a sample ago
+                    if (nv != v) {
+                        blep_add(res + x, (uint32_t)(((uint64_t)(phase - 0x10000) << 16) / step), nv - v);
+                        v = nv;
+                    }
+                }
+
+                out[x] += v;
+            }
+
+            myPhase[c] = phase;
+            continue;
+        }
+
+        if (step == 0x10000) {
+            for (x = 0; x < n; x++)
+                out[x] += next_tia_sample(c);
+            continue;
+        }
+
+        //a detuned channel is clocked zero, one or two times per sample
+        for (x = 0; x < n; x++) {
+            for (phase += step; phase >= 0x10000; phase -= 0x10000)
+                v = next_tia_sample(c);
+
+            out[x] += v;
+        }
+
+        myPhase[c] = phase;
+    }
 }
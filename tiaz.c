@@ -0,0 +1,243 @@
+/**
+ * TIAZ, our own lossless format for the recording archive. TIA output
+ * only changes level on clock edges, so the samples are turned into runs
+ * of (level, length), and a held note is the same few runs over and over.
+ * Each block of up to TIAZ_BLOCK runs picks the lag, up to TIAZ_MAX_LAG
+ * runs back, that predicts the most runs exactly. It then stores how many
+ * runs in a row were predicted exactly, followed by the level and length
+ * differences of the run that wasn't, all Rice coded. A held note costs a
+ * few bits per block however long its period, so ratios are in the
+ * hundreds on held notes and lower on busy passages and noise.
+ *
+ * The file is "TIAZ", the rate as 32 bits and the number of samples as
+ * 64 bits, little endian, then the blocks, each byte aligned:
+ *
+ *   16 bits   runs in the block, 0 ends the stream
+ *   10 bits   lag, 0 predicts level 0 and length 0
+ *   3x4 bits  Rice parameters of the exact run counts, levels and lengths
+ *   tokens    exact run count, then a level and a length difference
+ *             unless that reached the end of the block
+ *
+ * All three are zigzag coded. Runs can carry on from the previous block,
+ * so the stream decodes from the start only, which is all we need. It
+ * uses the bit writer and Rice helpers of flac.c.
+ */
+#define TIAZ_HEADER 16
+#define TIAZ_BLOCK 4096             /* runs per block */
+#define TIAZ_MAX_LAG 1023           /* furthest back a prediction can look, in runs */
+
+struct tzrun {
+    int32_t v, len;
+
+    bool operator==(const tzrun &o) const {
+        return v == o.v && len == o.len;
+    }
+};
+
+struct tiaz_enc {
+    vector<tzrun> runs;             /* up to TIAZ_MAX_LAG encoded runs, then the waiting ones */
+    size_t done;                    /* runs[done..] aren't encoded yet */
+    tzrun cur;                      /* the run still going */
+    uint64_t total;
+
+    tiaz_enc() {
+        reset();
+    }
+
+    void reset() {
+        runs.clear();
+        done = 0;
+        cur.v = cur.len = 0;
+        total = 0;
+    }
+};
+
+static inline void rice_put(bitwriter &bw, int32_t r, int p) {
+    uint32_t u = zigzag(r);
+
+    bw.unary(u >> p);
+    bw.put(u, p);
+}
+
+static inline int32_t rice_get(bitreader &br, int p) {
+    uint32_t u = (br.unary() << p) | br.get(p);
+
+    return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+static void tiaz_header(vector<uint8_t> &out, uint64_t total) {
+    out.insert(out.end(), (const uint8_t*)"TIAZ", (const uint8_t*)"TIAZ" + 4);
+
+    for (int x = 0; x < 4; x++)
+        out.push_back((uint32_t)FREQ >> (8*x));
+
+    for (int x = 0; x < 8; x++)
+        out.push_back(total >> (8*x));
+}
+
+/* encodes r[0..n-1], r[-hist..-1] are the runs before them */
+static void tiaz_block(vector<uint8_t> &out, const tzrun *r, int hist, int n) {
+    vector<int32_t> zs, dvs, dls;
+    int lag, bestlag = 0, best = 0, x, i;
+
+    for (lag = 1; lag <= TIAZ_MAX_LAG && lag < hist + n; lag++) {
+        int m = 0;
+
+        for (x = max(0, lag - hist); x < n; x++)
+            m += r[x] == r[x - lag];
+
+        if (m > best) {
+            best = m;
+            bestlag = lag;
+        }
+    }
+
+    for (i = 0; i < n;) {
+        int z = 0;
+
+        while (i < n && bestlag && i - bestlag >= -hist && r[i] == r[i - bestlag])
+            z++, i++;
+
+        zs.push_back(z);
+
+        if (i < n) {
+            bool pred = bestlag && i - bestlag >= -hist;
+
+            dvs.push_back(r[i].v - (pred ? r[i - bestlag].v : 0));
+            dls.push_back(r[i].len - (pred ? r[i - bestlag].len : 0));
+            i++;
+        }
+    }
+
+    uint64_t bits;
+    int kz = rice_param(&zs[0], zs.size(), &bits);
+    int kv = dvs.size() ? rice_param(&dvs[0], dvs.size(), &bits) : 0;
+    int kl = dls.size() ? rice_param(&dls[0], dls.size(), &bits) : 0;
+    bitwriter bw;
+
+    bw.put(n, 16);
+    bw.put(bestlag, 10);
+    bw.put(kz, 4);
+    bw.put(kv, 4);
+    bw.put(kl, 4);
+
+    for (x = 0; x < (int)zs.size(); x++) {
+        rice_put(bw, zs[x], kz);
+
+        if (x < (int)dvs.size()) {
+            rice_put(bw, dvs[x], kv);
+            rice_put(bw, dls[x], kl);
+        }
+    }
+
+    bw.align();
+    out.insert(out.end(), bw.buf.begin(), bw.buf.end());
+}
+
+/* encodes the waiting runs in blocks, all of them if flush */
+static void tiaz_flush(tiaz_enc &e, vector<uint8_t> &out, bool flush) {
+    while (e.runs.size() - e.done >= TIAZ_BLOCK || (flush && e.runs.size() > e.done)) {
+        int n = min(e.runs.size() - e.done, (size_t)TIAZ_BLOCK);
+
+        tiaz_block(out, &e.runs[e.done], e.done, n);
+        e.done += n;
+
+        //only TIAZ_MAX_LAG runs of history are ever looked at
+        if (e.done > TIAZ_MAX_LAG) {
+            e.runs.erase(e.runs.begin(), e.runs.begin() + (e.done - TIAZ_MAX_LAG));
+            e.done = TIAZ_MAX_LAG;
+        }
+    }
+}
+
+static void tiaz_push(tiaz_enc &e, const int16_t *s, size_t n, vector<uint8_t> &out) {
+    for (size_t x = 0; x < n; x++) {
+        if (e.cur.len && s[x] == e.cur.v) {
+            e.cur.len++;
+            continue;
+        }
+
+        if (e.cur.len)
+            e.runs.push_back(e.cur);
+
+        e.cur.v = s[x];
+        e.cur.len = 1;
+    }
+
+    e.total += n;
+    tiaz_flush(e, out, false);
+}
+
+static void tiaz_finish(tiaz_enc &e, vector<uint8_t> &out) {
+    if (e.cur.len)
+        e.runs.push_back(e.cur);
+
+    e.cur.len = 0;
+    tiaz_flush(e, out, true);
+    out.push_back(0);
+    out.push_back(0);
+}
+
+static bool tiaz_decode(const vector<uint8_t> &in, vector<int16_t> &out) {
+    vector<tzrun> runs;
+    uint64_t total = 0;
+    int x;
+
+    if (in.size() < TIAZ_HEADER || memcmp(&in[0], "TIAZ", 4))
+        return false;
+
+    for (x = 0; x < 8; x++)
+        total |= (uint64_t)in[8 + x] << (8*x);
+
+    bitreader br(&in[0], in.size());
+    br.pos = TIAZ_HEADER*8;
+
+    for (;;) {
+        if (br.eof())
+            return false;
+
+        int n = br.get(16), lag = br.get(10);
+
+        if (!n)
+            break;
+
+        int kz = br.get(4), kv = br.get(4), kl = br.get(4);
+        size_t base = runs.size(), end = base + n;
+
+        while (runs.size() < end && !br.eof()) {
+            int32_t z = rice_get(br, kz);
+
+            if (z < 0 || (size_t)z > end - runs.size() || (z && (!lag || runs.size() < (size_t)lag)))
+                return false;
+
+            for (; z > 0; z--) {
+                tzrun r = runs[runs.size() - lag];
+                runs.push_back(r);
+            }
+
+            if (runs.size() < end) {
+                bool pred = lag && runs.size() >= (size_t)lag;
+                tzrun r;
+
+                r.v = rice_get(br, kv) + (pred ? runs[runs.size() - lag].v : 0);
+                r.len = rice_get(br, kl) + (pred ? runs[runs.size() - lag].len : 0);
+
+                if (r.len <= 0)
+                    return false;
+
+                runs.push_back(r);
+            }
+        }
+
+        br.align();
+
+        for (size_t i = base; i < runs.size(); i++) {
+            if (out.size() + runs[i].len > total)
+                return false;
+
+            out.insert(out.end(), runs[i].len, (int16_t)runs[i].v);
+        }
+    }
+
+    return out.size() == total;
+}
@@ -0,0 +1,325 @@
+/**
+ * Transcribes a WAV into TIA notes. Every 1/FPS seconds a YIN pitch
+ * estimate is made, and the pitch is matched to the closest AUDC/AUDF in
+ * notedesc, or in the -notes table if one was loaded. Only the pure tone
+ * types in trtypes are tried, or the one given with -type, and the type
+ * of the previous note wins unless another is TR_STICKY cents closer.
+ * Runs of at least TR_MIN_FRAMES frames on the same AUDC/AUDF become
+ * notes, which are written with write_audacity() and write_asm().
+ *
+ * YIN's difference function is computed through an FFT cross correlation
+ * instead of the O(W*tau) double loop, and the frames are split across
+ * the worker pool in chunks of TR_CHUNK.
+ */
+#define TR_MIN_F0 40                /* Hz, sets the window length */
+#define TR_MAX_F0 4000
+#define TR_THRESHOLD 0.15f          /* YIN absolute threshold */
+#define TR_SILENCE 0.01f            /* frame RMS below this is a rest */
+#define TR_MIN_FRAMES 3
+#define TR_CHUNK 32
+#define TR_STICKY 25                /* cents another type must beat the previous one by */
+
+struct trcand {
+    int type, freq;
+    float hz;
+};
+
+struct trjob {
+    const vector<float> *in;
+    int rate, hop, W, taumax;
+    const fftplan *plan;
+    vector<float> *f0;              /* one per frame, 0 for unvoiced */
+};
+
+/* the types a pitch can sound like, the rest are buzzy or noise */
+static const int trtypes[] = {4, 6, 12, 14};
+
+static vector<trcand> trcands;
+static int tr_audc = -1;            /* -type, or -1 for trtypes */
+
+static bool read_wav(const char *name, vector<float> &out, int *rate) {
+    FILE *f = fopen(name, "rb");
+    char id[4];
+    uint8_t b[4];
+    int channels = 0, bits = 0;
+
+    if (!f)
+        return false;
+
+    if (fread(id, 4, 1, f) != 1 || memcmp(id, "RIFF", 4) || fread(b, 4, 1, f) != 1 ||
+        fread(id, 4, 1, f) != 1 || memcmp(id, "WAVE", 4)) {
+        fclose(f);
+        return false;
+    }
+
+    while (fread(id, 4, 1, f) == 1 && fread(b, 4, 1, f) == 1) {
+        uint32_t len = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+        vector<uint8_t> chunk(len + (len & 1));
+
+        if (chunk.size() && fread(&chunk[0], chunk.size(), 1, f) != 1)
+            break;
+
+        if (!memcmp(id, "fmt ", 4) && len >= 16) {
+            channels = chunk[2] | (chunk[3] << 8);
+            *rate = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (chunk[7] << 24);
+            bits = chunk[14] | (chunk[15] << 8);
+        } else if (!memcmp(id, "data", 4) && channels && (bits == 8 || bits == 16)) {
+            int frame = channels * bits/8;
+
+            //mix down to mono
+            for (size_t x = 0; x + frame <= len; x += frame) {
+                float sum = 0;
+
+                for (int c = 0; c < channels; c++)
+                    sum += bits == 8 ? (chunk[x+c] - 128) / 128.f
+                                     : (int16_t)(chunk[x+2*c] | (chunk[x+2*c+1] << 8)) / 32768.f;
+
+                out.push_back(sum / channels);
+            }
+
+            fclose(f);
+            return true;
+        }
+    }
+
+    fclose(f);
+    return false;
+}
+
+/* "C#4", -11 -> Hz */
+static float note_hz(const char *name, int tuning) {
+    static const int semis[] = {9, 11, 0, 2, 4, 5, 7};  /* A..G */
+    int semi = semis[name[0] - 'A'];
+
+    if (name[1] == '#')
+        semi++, name++;
+
+    //atoi() takes care of negative octaves like "B-1"
+    int midi = (atoi(name + 1) + 1) * 12 + semi;
+    return 440 * pow(2, (midi - 69) / 12.0 + tuning / 1200.0);
+}
+
+static bool tr_wanted(int audc) {
+    if (tr_audc >= 0)
+        return audc == tr_audc;
+
+    for (size_t x = 0; x < sizeof(trtypes)/sizeof(*trtypes); x++)
+        if (trtypes[x] == audc)
+            return true;
+
+    return false;
+}
+
+static void tr_init_cands() {
+    for (int type = 0; type < (int)(sizeof(typetab)/sizeof(*typetab)); type++) {
+        if (!tr_wanted(typetab[type]))
+            continue;
+
+        for (int freq = 0; freq < 32; freq++) {
+            const char *name;
+            int tuning;
+
+            if (!lookup_note(typetab[type], freq, &name, &tuning))
+                continue;
+
+            trcand cand = {type, freq, note_hz(name, tuning)};
+            trcands.push_back(cand);
+        }
+    }
+}
+
+/* index into trcands closest to hz in cents, staying on prevtype unless another type is TR_STICKY closer */
+static int tr_match(float hz, int prevtype) {
+    int best = -1, prev = -1;
+    float bestd = 0, prevd = 0;
+
+    for (size_t x = 0; x < trcands.size(); x++) {
+        float d = fabs(1200 * log2(hz / trcands[x].hz));
+
+        if (best < 0 || d < bestd) {
+            best = x;
+            bestd = d;
+        }
+
+        if (trcands[x].type == prevtype && (prev < 0 || d < prevd)) {
+            prev = x;
+            prevd = d;
+        }
+    }
+
+    return prev >= 0 && prevd <= bestd + TR_STICKY ? prev : best;
+}
+
+static void tr_frames(int job, void *arg) {
+    trjob *j = (trjob*)arg;
+    const vector<float> &in = *j->in;
+    int n = j->plan->n, W = j->W, tm = j->taumax;
+    vector<float> ar(n), ai(n), br(n), bi(n), d(tm + 1), energy(W + tm + 1);
+    int frames = j->f0->size();
+
+    for (int fr = job*TR_CHUNK; fr < frames && fr < (job+1)*TR_CHUNK; fr++) {
+        size_t start = (size_t)fr * j->hop;
+        int x, tau;
+        float rms = 0;
+
+        //a = the window, b = the window plus taumax more
+        for (x = 0; x < n; x++) {
+            float v = start + x < in.size() ? in[start + x] : 0;
+
+            ar[x] = x < W ? v : 0;
+            br[x] = x < W + tm ? v : 0;
+            ai[x] = bi[x] = 0;
+        }
+
+        for (x = 0; x < W; x++)
+            rms += ar[x]*ar[x];
+
+        if (sqrt(rms / W) < TR_SILENCE) {
+            (*j->f0)[fr] = 0;
+            continue;
+        }
+
+        for (x = 0, energy[0] = 0; x < W + tm; x++)
+            energy[x+1] = energy[x] + br[x]*br[x];
+
+        fft(*j->plan, &ar[0], &ai[0]);
+        fft(*j->plan, &br[0], &bi[0]);
+
+        //conj(A) * B, then the inverse by conjugating around a forward FFT
+        for (x = 0; x < n; x++) {
+            float r = ar[x]*br[x] + ai[x]*bi[x];
+            float i = ar[x]*bi[x] - ai[x]*br[x];
+
+            ar[x] = r;
+            ai[x] = -i;
+        }
+
+        fft(*j->plan, &ar[0], &ai[0]);
+
+        //d(tau) = sum a^2 + sum b[tau..]^2 - 2 * r(tau), then normalize
+        float sum = 0;
+        d[0] = 1;
+
+        for (tau = 1; tau <= tm; tau++) {
+            float dt = energy[W] + energy[tau + W] - energy[tau] - 2 * ar[tau] / n;
+
+            sum += dt;
+            d[tau] = sum > 0 ? dt * tau / sum : 1;
+        }
+
+        int taumin = j->rate / TR_MAX_F0;
+        float f0 = 0;
+
+        for (tau = taumin > 2 ? taumin : 2; tau < tm; tau++) {
+            if (d[tau] >= TR_THRESHOLD)
+                continue;
+
+            while (tau + 1 < tm && d[tau+1] < d[tau])
+                tau++;
+
+            //parabolic interpolation around the dip
+            float a = d[tau-1], b = d[tau], c = d[tau+1];
+            float den = a - 2*b + c;
+            float t = tau + (den ? 0.5f * (a - c) / den : 0);
+
+            f0 = j->rate / t;
+            break;
+        }
+
+        (*j->f0)[fr] = f0;
+    }
+}
+
+static int transcribe(const char *name) {
+    vector<float> in;
+    int rate = 0;
+
+    if (!read_wav(name, in, &rate) || rate <= 0) {
+        printf("Couldn't read %s, need an 8 or 16 bit PCM WAV\n", name);
+        return 1;
+    }
+
+    tr_init_cands();
+
+    if (!trcands.size()) {
+        printf("No notes to match for AUDC %i\n", tr_audc);
+        return 1;
+    }
+
+    trjob j;
+    fftplan plan;
+    int n = 1;
+
+    j.in = &in;
+    j.rate = rate;
+    j.hop = rate / FPS;
+    j.taumax = rate / TR_MIN_F0;
+    j.W = j.taumax;
+
+    while (n < 2*j.W + j.taumax)
+        n <<= 1;
+
+    fft_init(plan, n);
+    j.plan = &plan;
+
+    vector<float> f0(in.size() / j.hop);
+    j.f0 = &f0;
+
+    Uint32 t0 = SDL_GetTicks();
+    pool_run(tr_frames, (f0.size() + TR_CHUNK - 1) / TR_CHUNK, &j);
+    printf("Analysed %i frames of %s in %i ms on %i threads\n", (int)f0.size(), name,
+        (int)(SDL_GetTicks() - t0), num_threads);
+
+    vector<int> cand(f0.size());
+    int type = -1;
+
+    for (size_t x = 0; x < f0.size(); x++) {
+        cand[x] = f0[x] > 0 ? tr_match(f0[x], type) : -1;
+
+        if (cand[x] >= 0)
+            type = trcands[cand[x]].type;
+    }
+
+    //runs of the same candidate, short ones are treated as glitches and skipped
+    int prev = -1;
+
+    for (size_t x = 0; x < cand.size();) {
+        int c = cand[x];
+        size_t y = x + 1;
+
+        while (y < cand.size() && cand[y] == c)
+            y++;
+
+        if (y - x >= TR_MIN_FRAMES) {
+            if (c >= 0 && c != prev) {
+                char temp[32];
+                mark m;
+
+                m.type = trcands[c].type;
+                m.freq = trcands[c].freq;
+                m.t = x / (float)FPS;
+
+                sprint_binary(m.type, m.freq, temp);
+                m.binary = temp;
+                sprint_note(m.type, m.freq, temp);
+                m.note = temp;
+
+                notes.push_back(m);
+            }
+
+            prev = c;
+        }
+
+        x = y;
+    }
+
+    printf("Found %i notes\n", (int)notes.size());
+
+    string base = name;
+    if (base.size() > 4 && base.substr(base.size() - 4) == ".wav")
+        base.resize(base.size() - 4);
+
+    write_audacity(base + "-");
+    write_asm(base + "-");
+    return 0;
+}
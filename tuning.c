@@ -0,0 +1,229 @@
+/**
+ * Tuning analyser. Every AUDC x AUDF tone is rendered with the real
+ * engine, one tone per channel so the worker pool can render them in
+ * parallel, and the exact period of its bit pattern is found. The output
+ * is clocked once per TIA audio clock, so clock / period is the pitch at
+ * both the PAL and the NTSC clock.
+ *
+ * The fundamental is also measured with an FFT, and only tones where the
+ * two agree are written, as text that -notes loads in place of notedesc.
+ */
+#define TUNE_N 65536                /* FFT length */
+#define TUNE_WARMUP 4096            /* samples skipped before measuring */
+#define TUNE_MAX_CENTS 5            /* FFT and period have to agree this well */
+#define NTSC_CLOCK (3579545.0/114)
+#define PAL_CLOCK (3546894.0/114)
+
+struct tuneresult {
+    double cycles;                  /* fundamental in cycles per sample, 0 if none */
+    int period;                     /* exact period in samples, 0 if none found */
+};
+
+static struct {
+    char name[8];
+    int tuning;
+} loadednotes[16][32];
+static bool notes_loaded = false;
+
+static fftplan tune_plan;
+static tuneresult tune_results[16][32];
+
+static void tune_tone(int job, void *unused) {
+    int audc = job / 32, freq = job % 32, c = job;
+    vector<int> s(TUNE_WARMUP + TUNE_N);
+    vector<float> re(TUNE_N), im(TUNE_N), mag(TUNE_N/2);
+    tuneresult &r = tune_results[audc][freq];
+    double mean = 0;
+    int x, p;
+
+    myAUDC[c] = audc;
+    myAUDF[c] = freq;
+    myAUDV[c] = 8000;
+    myStep[c] = 0x10000;
+    render_channels(c, c+1, &s[0], NULL, s.size());
+
+    //exact period of the bit pattern
+    r.period = 0;
+
+    for (p = 1; p <= TUNE_N/2 && !r.period; p++) {
+        for (x = TUNE_WARMUP; x < TUNE_WARMUP + TUNE_N/2 && s[x] == s[x+p]; x++);
+
+        if (x == TUNE_WARMUP + TUNE_N/2)
+            r.period = p;
+    }
+
+    for (x = 0; x < TUNE_N; x++)
+        mean += s[TUNE_WARMUP + x];
+
+    mean /= TUNE_N;
+
+    for (x = 0; x < TUNE_N; x++) {
+        re[x] = (s[TUNE_WARMUP + x] - mean) * (0.5 - 0.5*cos(2*M_PI*x/TUNE_N));
+        im[x] = 0;
+    }
+
+    fft(tune_plan, &re[0], &im[0]);
+
+    int peak = 0;
+
+    for (x = 2; x < TUNE_N/2; x++) {
+        mag[x] = re[x]*re[x] + im[x]*im[x];
+
+        if (!peak || mag[x] > mag[peak])
+            peak = x;
+    }
+
+    r.cycles = 0;
+
+    if (!peak || mag[peak] < 1e-6)
+        return;
+
+    //the strongest peak may be a harmonic, look for the lowest one it is a multiple of
+    int fund = peak;
+
+    for (int div = 2; peak / div >= 2; div++) {
+        int lo = max(2, peak / div - 2), hi = min(TUNE_N/2 - 2, peak / div + 2), best = lo;
+
+        for (x = lo; x <= hi; x++)
+            if (mag[x] > mag[best])
+                best = x;
+
+        if (mag[best] > 0.01 * mag[peak] && mag[best] >= mag[best-1] && mag[best] >= mag[best+1])
+            fund = best;
+    }
+
+    //parabolic interpolation on the log magnitude
+    double a = log(mag[fund-1] + 1e-20), b = log(mag[fund] + 1e-20), d = log(mag[fund+1] + 1e-20);
+    double den = a - 2*b + d;
+
+    r.cycles = (fund + (den ? 0.5 * (a - d) / den : 0)) / TUNE_N;
+}
+
+static void hz_to_note(double hz, char *name, int *tuning) {
+    static const char *names[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+    double midi = 69 + 12 * log(hz / 440) / log(2.0);
+    int m = (int)floor(midi + 0.5);
+
+    *tuning = (int)floor((midi - m) * 100 + 0.5);
+    sprintf(name, "%s%i", names[((m % 12) + 12) % 12], (int)floor(m / 12.0) - 1);
+}
+
+static bool write_tuning(const char *name, double clock) {
+    FILE *f = fopen(name, "w");
+    int bad = 0;
+
+    if (!f)
+        return false;
+
+    fprintf(f, "# AUDC AUDF note cents Hz, measured at %.1f Hz\n", clock);
+
+    for (int audc = 0; audc < 16; audc++)
+        for (int freq = 0; freq < 32; freq++) {
+            const tuneresult &r = tune_results[audc][freq];
+            char note[16];
+            int tuning;
+
+            if (!r.cycles)
+                continue;
+
+            //only trust the FFT where the bit pattern agrees with it
+            if (!r.period || fabs(1200 * log(r.cycles * r.period) / log(2.0)) > TUNE_MAX_CENTS) {
+                bad++;
+                continue;
+            }
+
+            //the period is exact, the FFT is only good to a few cents
+            double hz = clock / r.period;
+
+            hz_to_note(hz, note, &tuning);
+            fprintf(f, "%i %i %s %+i %.3f\n", audc, freq, note, tuning, hz);
+        }
+
+    fclose(f);
+    printf("Wrote %s, %i tones left out where FFT and period disagree\n", name, bad);
+    return true;
+}
+
+static int analyse_tuning() {
+    Uint32 t0 = SDL_GetTicks();
+
+    fft_init(tune_plan, TUNE_N);
+    pool_run(tune_tone, 16*32, NULL);
+    printf("Analysed 512 tones in %i ms on %i threads\n", (int)(SDL_GetTicks() - t0), num_threads);
+
+    return write_tuning("notes-pal.txt", PAL_CLOCK) && write_tuning("notes-ntsc.txt", NTSC_CLOCK) ? 0 : 1;
+}
+
+/* [A-G]#?-?[0-9]+, what hz_to_note() writes and note_hz() can read */
+static bool valid_note_name(const char *s) {
+    if (*s < 'A' || *s > 'G')
+        return false;
+
+    if (*++s == '#')
+        s++;
+
+    if (*s == '-')
+        s++;
+
+    if (*s < '0' || *s > '9')
+        return false;
+
+    while (*s >= '0' && *s <= '9')
+        s++;
+
+    return !*s;
+}
+
+static bool load_tuning(const char *name) {
+    FILE *f = fopen(name, "r");
+    char line[256], note[8];
+    int audc, freq, tuning, n = 0, bad = 0;
+
+    if (!f)
+        return false;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%i %i %7s %i", &audc, &freq, note, &tuning) != 4 ||
+            audc < 0 || audc >= 16 || freq < 0 || freq >= 32)
+            continue;
+
+        if (!valid_note_name(note)) {
+            bad++;
+            continue;
+        }
+
+        strcpy(loadednotes[audc][freq].name, note);
+        loadednotes[audc][freq].tuning = tuning;
+        n++;
+    }
+
+    fclose(f);
+
+    if (bad)
+        printf("Skipped %i lines in %s with note names that aren't like C#4\n", bad, name);
+
+    //an empty or foreign file would otherwise leave every note unnamed
+    if (!n)
+        return false;
+
+    printf("Loaded %i tunings from %s\n", n, name);
+    return notes_loaded = true;
+}
+
+/* name and tuning of AUDC/AUDF, from -notes if given, else notedesc */
+static bool lookup_note(int audc, int freq, const char **name, int *tuning) {
+    if (notes_loaded) {
+        *name = loadednotes[audc][freq].name;
+        *tuning = loadednotes[audc][freq].tuning;
+        return (*name)[0] != 0;
+    }
+
+    int t = audcnotesnamemap[audc];
+
+    if (t < 0 || !notedesc[t][freq].name[0])
+        return false;
+
+    *name = notedesc[t][freq].name;
+    *tuning = notedesc[t][freq].tuning;
+    return true;
+}
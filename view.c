@@ -0,0 +1,235 @@
+/**
+ * Live scope, spectrum and recording overview in the SDL window.
+ *
+ * The samples are read straight out of the journal's ring, so the audio
+ * callback never waits on the display. The main thread drains what's new
+ * into a min/max pyramid: level 0 holds the min and max of every
+ * VIEW_BLOCK samples, and each level above merges pairs of the one below.
+ * A column of the overview then reads at most a handful of entries from
+ * the coarsest level that fits it, whatever the zoom.
+ *
+ * Each panel remembers the span it drew in every column and only redraws
+ * and updates the columns that changed.
+ */
+#define VIEW_W 320
+#define VIEW_PANEL 80           /* height of each panel */
+#define VIEW_BLOCK 64           /* samples per entry in level 0 */
+#define VIEW_LEVELS 24
+#define VIEW_FFT 512
+#define VIEW_MS 40              /* shortest time between redraws */
+
+enum {
+    VIEW_SCOPE,
+    VIEW_SPECTRUM,
+    VIEW_OVERVIEW,
+    VIEW_PANELS,
+};
+
+struct peak {
+    int16_t lo, hi;
+};
+
+static uint64_t view_r = 0;             /* next sample in the journal to add */
+
+static vector<peak> view_pyr[VIEW_LEVELS];
+static peak view_acc;
+static int view_accn = 0;
+static size_t view_total = 0;           /* samples in the pyramid */
+static int view_zoom = 0;               /* overview shows the last view_total >> view_zoom samples */
+
+static SDL_Surface *view_screen = NULL;
+static Uint32 view_bg, view_fg[VIEW_PANELS];
+static int16_t view_drawn[VIEW_PANELS][VIEW_W][2];  /* top and bottom row per column */
+static Uint32 view_last = 0;
+static fftplan view_plan;
+
+static inline peak view_merge(peak a, peak b) {
+    peak ret = {min(a.lo, b.lo), max(a.hi, b.hi)};
+    return ret;
+}
+
+static void view_add(int16_t v) {
+    if (!view_accn++) {
+        view_acc.lo = view_acc.hi = v;
+    } else {
+        view_acc.lo = min(view_acc.lo, v);
+        view_acc.hi = max(view_acc.hi, v);
+    }
+
+    view_total++;
+
+    if (view_accn < VIEW_BLOCK)
+        return;
+
+    view_accn = 0;
+    view_pyr[0].push_back(view_acc);
+
+    //carry up while the level has a complete pair
+    for (int k = 0; k + 1 < VIEW_LEVELS && !(view_pyr[k].size() & 1); k++) {
+        size_t s = view_pyr[k].size();
+        view_pyr[k+1].push_back(view_merge(view_pyr[k][s-2], view_pyr[k][s-1]));
+    }
+}
+
+/**
+ * min/max of samples [a, b), rounded out to whole blocks. Level k has
+ * entries up to the last complete one only, so the tail past it comes
+ * from the finer levels and then from the partial block in view_acc.
+ */
+static peak view_range(size_t a, size_t b) {
+    int k = 0;
+    bool any = false;
+    peak ret = {0, 0};
+
+    while (k + 1 < VIEW_LEVELS && ((size_t)VIEW_BLOCK << (k+1)) <= b - a)
+        k++;
+
+    for (; k >= 0 && a < b; k--) {
+        size_t bs = (size_t)VIEW_BLOCK << k;
+        size_t i = a / bs, end = min((b + bs - 1) / bs, view_pyr[k].size());
+
+        for (; i < end; i++) {
+            ret = any ? view_merge(ret, view_pyr[k][i]) : view_pyr[k][i];
+            any = true;
+            a = (i + 1) * bs;
+        }
+    }
+
+    if (a < b && view_accn)
+        ret = any ? view_merge(ret, view_acc) : view_acc;
+
+    return ret;
+}
+
+static void view_clear() {
+    for (int k = 0; k < VIEW_LEVELS; k++)
+        view_pyr[k].clear();
+
+    view_accn = 0;
+    view_total = 0;
+}
+
+/* call after journal_init() */
+static void view_init(SDL_Surface *screen) {
+    view_screen = screen;
+    view_r = journal_w;
+    fft_init(view_plan, VIEW_FFT);
+    memset(view_drawn, -1, sizeof(view_drawn));
+
+    if (!screen)
+        return;
+
+    view_bg = SDL_MapRGB(screen->format, 0, 0, 0);
+    view_fg[VIEW_SCOPE] = SDL_MapRGB(screen->format, 0x40, 0xff, 0x40);
+    view_fg[VIEW_SPECTRUM] = SDL_MapRGB(screen->format, 0xff, 0xc0, 0x40);
+    view_fg[VIEW_OVERVIEW] = SDL_MapRGB(screen->format, 0x40, 0xc0, 0xff);
+
+    SDL_FillRect(screen, NULL, view_bg);
+    SDL_UpdateRects(screen, 0, NULL);
+}
+
+/* draws columns whose span changed, adds their dirty rectangles to rects */
+static void view_panel(int panel, const int16_t (*cols)[2], vector<SDL_Rect> &rects) {
+    int x, y0 = panel * VIEW_PANEL;
+
+    for (x = 0; x < VIEW_W; x++) {
+        if (cols[x][0] == view_drawn[panel][x][0] && cols[x][1] == view_drawn[panel][x][1])
+            continue;
+
+        SDL_Rect col = {(Sint16)x, (Sint16)y0, 1, VIEW_PANEL};
+        SDL_Rect span = {(Sint16)x, (Sint16)(y0 + cols[x][0]), 1, (Uint16)(cols[x][1] - cols[x][0] + 1)};
+
+        SDL_FillRect(view_screen, &col, view_bg);
+        SDL_FillRect(view_screen, &span, view_fg[panel]);
+        view_drawn[panel][x][0] = cols[x][0];
+        view_drawn[panel][x][1] = cols[x][1];
+
+        //extend the previous rectangle if it ends right here
+        if (rects.size() && rects.back().y == y0 && rects.back().x + rects.back().w == x)
+            rects.back().w++;
+        else
+            rects.push_back(col);
+    }
+}
+
+static inline int16_t view_y(int v) {
+    int y = VIEW_PANEL/2 - 1 - v * (VIEW_PANEL/2) / 32768;
+    return y < 0 ? 0 : y >= VIEW_PANEL ? VIEW_PANEL - 1 : y;
+}
+
+/* called from the main loop, drains the ring and redraws what changed */
+static void view_update() {
+    uint64_t w = journal_w;
+    const int16_t *ring = journal->samples;
+    int16_t cols[VIEW_W][2];
+    vector<SDL_Rect> rects;
+    int x;
+
+    memory_barrier();
+
+    //if we fell more than a ring behind, skip what was overwritten
+    if (w - view_r > JOURNAL_SAMPLES)
+        view_r = w - JOURNAL_SAMPLES;
+
+    for (; view_r != w; view_r++)
+        view_add(ring[view_r & (JOURNAL_SAMPLES-1)]);
+
+    if (!view_screen || SDL_GetTicks() - view_last < VIEW_MS)
+        return;
+
+    view_last = SDL_GetTicks();
+
+    //scope: the last two samples per column
+    for (x = 0; x < VIEW_W; x++) {
+        int a = ring[(w - 2*VIEW_W + 2*x) & (JOURNAL_SAMPLES-1)];
+        int b = ring[(w - 2*VIEW_W + 2*x + 1) & (JOURNAL_SAMPLES-1)];
+
+        cols[x][0] = view_y(max(a, b));
+        cols[x][1] = view_y(min(a, b));
+    }
+
+    view_panel(VIEW_SCOPE, cols, rects);
+
+    //spectrum: Hann windowed, 0..-90 dB over the panel height
+    float re[VIEW_FFT], im[VIEW_FFT];
+
+    for (x = 0; x < VIEW_FFT; x++) {
+        re[x] = ring[(w - VIEW_FFT + x) & (JOURNAL_SAMPLES-1)] * (0.5f - 0.5f*cos(2*M_PI*x/VIEW_FFT)) / (32768.f*VIEW_FFT/4);
+        im[x] = 0;
+    }
+
+    fft(view_plan, re, im);
+
+    for (x = 0; x < VIEW_W; x++) {
+        int bin = x * (VIEW_FFT/2) / VIEW_W;
+        float db = 10*log10(re[bin]*re[bin] + im[bin]*im[bin] + 1e-12f);
+        int h = (int)((db + 90) * VIEW_PANEL / 90);
+
+        h = h < 0 ? 0 : h > VIEW_PANEL ? VIEW_PANEL : h;
+        cols[x][0] = VIEW_PANEL - h;
+        cols[x][1] = VIEW_PANEL - 1;
+    }
+
+    view_panel(VIEW_SPECTRUM, cols, rects);
+
+    //overview of the last view_total >> view_zoom samples
+    size_t span = view_total >> view_zoom, start = view_total - span;
+
+    for (x = 0; x < VIEW_W; x++) {
+        size_t a = start + span * x / VIEW_W, b = start + span * (x+1) / VIEW_W;
+
+        if (b <= a) {
+            cols[x][0] = cols[x][1] = view_y(0);
+            continue;
+        }
+
+        peak m = view_range(a, b);
+        cols[x][0] = view_y(m.hi);
+        cols[x][1] = view_y(m.lo);
+    }
+
+    view_panel(VIEW_OVERVIEW, cols, rects);
+
+    if (rects.size())
+        SDL_UpdateRects(view_screen, rects.size(), &rects[0]);
+}